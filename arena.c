@@ -0,0 +1,121 @@
+/*
+ * arena.c - per-request bump allocator
+ *
+ * An arena hands out memory by bumping a pointer through a block and
+ * takes it all back at once with arena_reset, so scratch buffers cost no
+ * malloc and no free. The first block is kept across resets; a request
+ * that outgrows it chains extra blocks, which the reset returns. Each
+ * worker (or connection) owns its arena, so nothing here locks except
+ * the global counters.
+ */
+#include "arena.h"
+
+static arena_stats_t totals;
+
+/* Blocks are malloc'd lazily, so an unused arena costs nothing. */
+void arena_init(arena_t *a, size_t block_size)
+{
+  a->first = a->cur = NULL;
+  a->used = 0;
+  a->block_size = block_size;
+  a->allocs = a->mallocs = 0;
+  a->bytes = 0;
+}
+
+static size_t arena_round(size_t n)
+{
+  return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+void *arena_alloc(arena_t *a, size_t n)
+{
+  arena_block *b;
+  void *p;
+
+  n = arena_round(n ? n : 1);
+  if (a->cur == NULL || a->cur->size - a->used < n) {
+    size_t size = n > a->block_size ? n : a->block_size;
+
+    b = Malloc(sizeof(arena_block) + size);
+    b->next = NULL;
+    b->size = size;
+    if (a->cur)
+      a->cur->next = b;
+    else
+      a->first = b;
+    a->cur = b;
+    a->used = 0;
+    a->mallocs++;
+  }
+
+  p = a->cur->data + a->used;
+  a->used += n;
+  a->allocs++;
+  a->bytes += n;
+  return p;
+}
+
+/*
+ * arena_grow - Resize p from old to n bytes. The newest allocation grows
+ *     in place while its block has room; anything else is copied.
+ */
+void *arena_grow(arena_t *a, void *p, size_t old, size_t n)
+{
+  void *q;
+
+  old = arena_round(old);
+  n = arena_round(n);
+  if (n <= old)
+    return p;
+  if (a->cur && (char *)p == a->cur->data + a->used - old &&
+      a->cur->size - a->used >= n - old) {
+    a->used += n - old;
+    a->bytes += n - old;
+    return p;
+  }
+  q = arena_alloc(a, n);
+  memcpy(q, p, old);
+  return q;
+}
+
+/* Take back everything, keeping the first block. Counts one request. */
+void arena_reset(arena_t *a)
+{
+  arena_block *b, *next;
+
+  if (a->first) {
+    for (b = a->first->next; b; b = next) {
+      next = b->next;
+      Free(b);
+    }
+    a->first->next = NULL;
+  }
+  a->cur = a->first;
+  a->used = 0;
+
+  __atomic_fetch_add(&totals.requests, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&totals.allocs, a->allocs, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&totals.mallocs, a->mallocs, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&totals.bytes, a->bytes, __ATOMIC_RELAXED);
+  a->allocs = a->mallocs = 0;
+  a->bytes = 0;
+}
+
+void arena_free(arena_t *a)
+{
+  arena_block *b, *next;
+
+  for (b = a->first; b; b = next) {
+    next = b->next;
+    Free(b);
+  }
+  arena_init(a, a->block_size);
+}
+
+void arena_stats(arena_stats_t *s)
+{
+  s->requests = __atomic_load_n(&totals.requests, __ATOMIC_RELAXED);
+  s->allocs = __atomic_load_n(&totals.allocs, __ATOMIC_RELAXED);
+  s->mallocs = __atomic_load_n(&totals.mallocs, __ATOMIC_RELAXED);
+  s->bytes = __atomic_load_n(&totals.bytes, __ATOMIC_RELAXED);
+}
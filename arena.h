@@ -0,0 +1,38 @@
+#pragma once
+
+#include "csapp.h"
+
+/* Bump allocator for request-scoped memory */
+#define ARENA_ALIGN 16
+
+typedef struct arena_block
+{
+  struct arena_block *next;
+  size_t size;
+  char data[];
+} arena_block;
+
+typedef struct
+{
+  arena_block *first, *cur;     // first is kept across resets
+  size_t used;                  // bytes handed out from cur
+  size_t block_size;
+
+  /* since the last reset */
+  long allocs, mallocs;
+  size_t bytes;
+} arena_t;
+
+/* Totals over all arenas, added up at every reset */
+typedef struct
+{
+  long requests, allocs, mallocs;
+  size_t bytes;
+} arena_stats_t;
+
+void arena_init(arena_t *a, size_t block_size);
+void *arena_alloc(arena_t *a, size_t n);
+void *arena_grow(arena_t *a, void *p, size_t old, size_t n);
+void arena_reset(arena_t *a);
+void arena_free(arena_t *a);
+void arena_stats(arena_stats_t *s);
@@ -0,0 +1,93 @@
+/*
+ * cache_bench.c - cache throughput as threads are added
+ *
+ * Every thread hammers the cache for a fixed time with lookups of random
+ * URIs from a shared key space, caching the URI on a miss. The key space
+ * is a few times MAX_CACHE_SIZE, so misses keep evicting. Reports total
+ * operations per second for 1, 2, 4, ... threads.
+ *
+ * cache1_bench is the same program built with a single shard, i.e. one
+ * lock for the whole cache.
+ *
+ * usage: cache_bench [max threads]
+ */
+#include "csapp.h"
+#include "cache.h"
+
+#define KEYS        4096
+#define OBJ_SIZE    1024
+#define RUN_MS      500
+
+static char *keys[KEYS];
+static volatile int stop;
+
+typedef struct
+{
+  pthread_t tid;
+  unsigned int seed;
+  long ops;
+} worker_t;
+
+static void *worker(void *vargp)
+{
+  worker_t *w = vargp;
+  unsigned int x = w->seed;
+  long ops = 0;
+  char *key;
+  cache_node *node;
+
+  while (!stop) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    key = keys[x % KEYS];
+    if ((node = search_cache(key)) != NULL)
+      cache_unpin(node);
+    else
+      cache_insert(key, slab_alloc(OBJ_SIZE), 0, OBJ_SIZE);
+    ops++;
+  }
+  w->ops = ops;
+  return NULL;
+}
+
+static double run(int nthreads)
+{
+  worker_t *w = Calloc(nthreads, sizeof(worker_t));
+  long ops = 0;
+  int i;
+
+  stop = 0;
+  for (i = 0; i < nthreads; i++) {
+    w[i].seed = 2463534242u + i * 7919;
+    Pthread_create(&w[i].tid, NULL, worker, &w[i]);
+  }
+  usleep(RUN_MS * 1000);
+  stop = 1;
+  for (i = 0; i < nthreads; i++) {
+    Pthread_join(w[i].tid, NULL);
+    ops += w[i].ops;
+  }
+  Free(w);
+  return ops * 1000.0 / RUN_MS;
+}
+
+int main(int argc, char **argv)
+{
+  int max = argc > 1 ? atoi(argv[1]) : 2 * sysconf(_SC_NPROCESSORS_ONLN);
+  char key[MAXLINE];
+  int i, n;
+
+  if (max < 8)
+    max = 8;
+  for (i = 0; i < KEYS; i++) {
+    snprintf(key, sizeof(key), "http://origin:8080/objects/%d.html", i);
+    keys[i] = strdup(key);
+  }
+
+  init_cache();
+  printf("%d shards, %ld CPUs\n", CACHE_SHARDS, sysconf(_SC_NPROCESSORS_ONLN));
+  for (n = 1; n <= max; n *= 2)
+    printf("%3d threads %12.0f ops/s\n", n, run(n));
+  return 0;
+}
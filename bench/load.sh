@@ -0,0 +1,56 @@
+#!/bin/bash
+#
+# load.sh - load_bench through the proxy, with tiny as the origin
+#
+# Makes one file per size in a scratch directory, serves it with a
+# threaded tiny, starts the proxy in front and runs load_bench against
+# them. The JSON result goes to stdout; arguments are passed on to
+# load_bench.
+#
+#     usage: bench/load.sh [load_bench options]
+#     e.g.:  SIZES="1K 50K 500K" PROXY_FLAGS=-t bench/load.sh -c 32 -m 0.8
+#
+#     SIZES        object sizes, as head -c takes them (default "1K 10K 100K")
+#     PROXY_FLAGS  extra proxy options, e.g. -t for the thread pool
+#     TINY_THREADS tiny's workers (default 16)
+#
+
+SIZES=${SIZES:-"1K 10K 100K"}
+TINY_THREADS=${TINY_THREADS:-16}
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+DIR=$(mktemp -d)
+PIDS=""
+
+function cleanup {
+    [ -n "${PIDS}" ] && kill ${PIDS} 2> /dev/null
+    rm -rf "${DIR}"
+}
+trap cleanup EXIT
+
+# wait_for_port - wait up to 5 seconds for a server to listen on port $1
+function wait_for_port {
+    for i in $(seq 50); do
+        (exec 3<> /dev/tcp/localhost/$1) 2> /dev/null && return 0
+        sleep 0.1
+    done
+    echo "load.sh: nothing listening on port $1" >&2
+    exit 1
+}
+
+PATHS=""
+for size in ${SIZES}; do
+    head -c "${size}" /dev/urandom > "${DIR}/obj_${size}" || exit 1
+    PATHS="${PATHS} /obj_${size}"
+done
+
+ORIGIN_PORT=$("${ROOT}/free-port.sh")
+(cd "${DIR}" && exec "${ROOT}/tiny/tiny" -t ${TINY_THREADS} ${ORIGIN_PORT} > /dev/null) &
+PIDS="$!"
+wait_for_port ${ORIGIN_PORT}
+
+PROXY_PORT=$("${ROOT}/free-port.sh")
+"${ROOT}/proxy" ${PROXY_FLAGS} ${PROXY_PORT} > /dev/null &
+PIDS="${PIDS} $!"
+wait_for_port ${PROXY_PORT}
+
+"${ROOT}/bench/load_bench" "$@" localhost:${PROXY_PORT} localhost:${ORIGIN_PORT} ${PATHS}
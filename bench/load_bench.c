@@ -0,0 +1,282 @@
+/*
+ * load_bench.c - closed-loop load through the proxy
+ *
+ * Each of conns threads owns one client connection and sends the next
+ * request as soon as the last response is in, for the given number of
+ * seconds. Requests name the origin in absolute form and pick one of the
+ * paths at random. A hit_ratio share of them ask for the path as it is,
+ * which the proxy can answer from its cache once it holds it. The rest
+ * add a query string never used before ("?miss=..."), which forces a
+ * trip to the origin. Objects over MAX_OBJECT_SIZE are never cached, so
+ * they miss whatever the mix.
+ *
+ * Connections are kept alive by default; with -f every request opens a
+ * fresh one and asks for "Connection: close", and its latency includes
+ * the connect. Latencies go into the same log-linear histograms as the
+ * proxy's own stats.
+ *
+ * The result is one JSON object on stdout (or in -o file): requests/s,
+ * MB/s, latency percentiles and errors. It also has the proxy's own hit
+ * and miss counts for the run, taken from STATS_PATH before and after.
+ *
+ * usage: load_bench [-c conns] [-d seconds] [-m hit_ratio] [-f] [-o file]
+ *                   <proxy host:port> <origin host:port> <path>...
+ *
+ * bench/load.sh runs it against the proxy with tiny as the origin.
+ */
+#include "csapp.h"
+#include "stats.h"
+
+#define MAX_CONNS 1024
+
+typedef struct
+{
+  int id;
+  pthread_t tid;
+  long requests, errors, bytes;
+  long hist[HIST_BUCKETS];      // ns per request
+} client_t;
+
+static char *proxy_host, *proxy_port, *origin;
+static char **paths;
+static int npaths, fresh;
+static double hit_ratio = 1.0;
+static int stop;
+
+/* "host:port" into host and port; port is NULL if there is no colon */
+static void split_hostport(char *s, char **host, char **port)
+{
+  char *p = strrchr(s, ':');
+
+  *host = s;
+  *port = NULL;
+  if (p != NULL) {
+    *p = '\0';
+    *port = p + 1;
+  }
+}
+
+static int connect_proxy(void)
+{
+  struct timeval tv = {5, 0};   // a lost response must not hang the run
+  int fd = open_clientfd(proxy_host, proxy_port);
+
+  if (fd >= 0)
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  return fd;
+}
+
+/*
+ * Read one response from rp and throw its body away. Returns its size,
+ * or -1 if it is cut short or not a 200. *close is set when the
+ * connection can't carry another request.
+ */
+static long read_response(rio_t *rp, int *close)
+{
+  char line[MAXLINE], body[MAXBUF];
+  long len = -1, total = 0, want;
+  int status = 0;
+  ssize_t n;
+
+  if ((n = rio_readlineb(rp, line, sizeof(line))) <= 0 ||
+      sscanf(line, "HTTP/%*d.%*d %d", &status) != 1)
+    return -1;
+  total += n;
+  while ((n = rio_readlineb(rp, line, sizeof(line))) > 0) {
+    total += n;
+    if (!strcmp(line, "\r\n"))
+      break;
+    if (!strncasecmp(line, "Content-length:", 15))
+      len = strtol(line + 15, NULL, 10);
+    else if (!strncasecmp(line, "Connection:", 11) &&
+             !strncasecmp(line + 11 + strspn(line + 11, " "), "close", 5))
+      *close = 1;
+  }
+  if (n <= 0)
+    return -1;
+
+  // without a length the body runs to EOF
+  if (len < 0)
+    *close = 1;
+  while (len != 0) {
+    want = len < 0 || len > sizeof(body) ? sizeof(body) : len;
+    if ((n = rio_readnb(rp, body, want)) <= 0)
+      break;
+    total += n;
+    if (len > 0)
+      len -= n;
+  }
+  return len > 0 || status != 200 ? -1 : total;
+}
+
+static void *client(void *vargp)
+{
+  client_t *c = vargp;
+  unsigned int seed = c->id * 7919 + 1;
+  char req[MAXLINE], query[64];
+  rio_t rio;
+  long seq = 0, t, got;
+  int fd = -1, n, close_after;
+
+  while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+    char *path = paths[rand_r(&seed) % npaths];
+    int miss = rand_r(&seed) >= hit_ratio * ((double)RAND_MAX + 1);
+
+    query[0] = '\0';
+    if (miss)
+      snprintf(query, sizeof(query), "?miss=%d-%ld", c->id, seq++);
+    n = snprintf(req, sizeof(req), "GET http://%s%s%s HTTP/1.1\r\n"
+                 "Host: %s\r\n%s\r\n", origin, path, query, origin,
+                 fresh ? "Connection: close\r\n" : "");
+
+    t = stats_now();
+    if (fd < 0) {
+      if ((fd = connect_proxy()) < 0) {
+        c->errors++;
+        usleep(10000);
+        continue;
+      }
+      Rio_readinitb(&rio, fd);
+    }
+    close_after = fresh;
+    got = -1;
+    if (rio_writen(fd, req, n) == n)
+      got = read_response(&rio, &close_after);
+    if (got < 0) {
+      c->errors++;
+      close_after = 1;
+    }
+    else {
+      c->requests++;
+      c->bytes += got;
+      c->hist[hist_bucket(stats_now() - t)]++;
+    }
+    if (close_after) {
+      Close(fd);
+      fd = -1;
+    }
+  }
+  if (fd >= 0)
+    Close(fd);
+  return NULL;
+}
+
+/* The proxy's counter called name, or -1 if its stats aren't to be had */
+static long proxy_stat(const char *name)
+{
+  char req[MAXLINE], line[MAXLINE];
+  size_t len = strlen(name);
+  long v = -1;
+  rio_t rio;
+  int fd;
+
+  if ((fd = connect_proxy()) < 0)
+    return -1;
+  snprintf(req, sizeof(req), "GET %s HTTP/1.0\r\n\r\n", STATS_PATH);
+  Rio_readinitb(&rio, fd);
+  if (rio_writen(fd, req, strlen(req)) >= 0)
+    while (rio_readlineb(&rio, line, sizeof(line)) > 0)
+      if (!strncmp(line, name, len) && line[len] == ' ')
+        v = strtol(line + len + 1, NULL, 10);
+  Close(fd);
+  return v;
+}
+
+int main(int argc, char **argv)
+{
+  client_t *cs;
+  long hist[HIST_BUCKETS] = {0}, requests = 0, errors = 0, bytes = 0;
+  long hits0, misses0, hits, misses;
+  double seconds = 5, elapsed, t;
+  char *out = NULL, *ph, *pp;
+  int conns = 16, opt, i, b;
+  FILE *fp = stdout;
+
+  while ((opt = getopt(argc, argv, "c:d:m:fo:")) != -1) {
+    switch (opt) {
+    case 'c':
+      conns = atoi(optarg);
+      break;
+    case 'd':
+      seconds = atof(optarg);
+      break;
+    case 'm':
+      hit_ratio = atof(optarg);
+      break;
+    case 'f':
+      fresh = 1;
+      break;
+    case 'o':
+      out = optarg;
+      break;
+    default:
+      goto usage;
+    }
+  }
+  if (argc - optind < 3 || conns < 1 || conns > MAX_CONNS || seconds <= 0 ||
+      hit_ratio < 0 || hit_ratio > 1)
+    goto usage;
+
+  origin = argv[optind + 1];
+  split_hostport(strdup(argv[optind]), &ph, &pp);
+  if (pp == NULL)
+    goto usage;
+  proxy_host = ph;
+  proxy_port = pp;
+  paths = argv + optind + 2;
+  npaths = argc - optind - 2;
+  Signal(SIGPIPE, SIG_IGN);
+
+  hits0 = proxy_stat("cache_hits");
+  misses0 = proxy_stat("cache_misses");
+
+  cs = Calloc(conns, sizeof(client_t));
+  t = stats_now();
+  for (i = 0; i < conns; i++) {
+    cs[i].id = i;
+    Pthread_create(&cs[i].tid, NULL, client, &cs[i]);
+  }
+  usleep(seconds * 1e6);
+  __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+  for (i = 0; i < conns; i++) {
+    Pthread_join(cs[i].tid, NULL);
+    requests += cs[i].requests;
+    errors += cs[i].errors;
+    bytes += cs[i].bytes;
+    for (b = 0; b < HIST_BUCKETS; b++)
+      hist[b] += cs[i].hist[b];
+  }
+  elapsed = (stats_now() - t) / 1e9;
+
+  hits = proxy_stat("cache_hits");
+  misses = proxy_stat("cache_misses");
+
+  if (out != NULL && (fp = fopen(out, "w")) == NULL)
+    unix_error(out);
+  fprintf(fp, "{\"proxy\": \"%s:%s\", \"origin\": \"%s\", \"paths\": %d, "
+          "\"connections\": %d, \"keep_alive\": %s, \"hit_ratio\": %.3f, "
+          "\"seconds\": %.3f,\n", ph, pp, origin, npaths, conns,
+          fresh ? "false" : "true", hit_ratio, elapsed);
+  fprintf(fp, " \"requests\": %ld, \"errors\": %ld, \"bytes\": %ld, "
+          "\"requests_per_s\": %.1f, \"mb_per_s\": %.3f,\n",
+          requests, errors, bytes, requests / elapsed, bytes / elapsed / 1e6);
+  fprintf(fp, " \"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+          "\"p999\": %.1f},\n",
+          hist_quantile(hist, requests, 0.5) / 1e3,
+          hist_quantile(hist, requests, 0.9) / 1e3,
+          hist_quantile(hist, requests, 0.99) / 1e3,
+          hist_quantile(hist, requests, 0.999) / 1e3);
+  if (hits0 >= 0 && hits >= 0)
+    fprintf(fp, " \"proxy_cache_hits\": %ld, \"proxy_cache_misses\": %ld}\n",
+            hits - hits0, misses - misses0);
+  else
+    fprintf(fp, " \"proxy_cache_hits\": null, \"proxy_cache_misses\": null}\n");
+  if (fp != stdout)
+    fclose(fp);
+  return errors > 0 && requests == 0;
+
+usage:
+  fprintf(stderr, "usage: %s [-c conns] [-d seconds] [-m hit_ratio] [-f] "
+          "[-o file] <proxy host:port> <origin host:port> <path>...\n", argv[0]);
+  return 1;
+}
@@ -0,0 +1,78 @@
+/*
+ * log_bench.c - cost of logging a request line
+ *
+ * Threads log a typical "Accepted connection" line as fast as they can
+ * to /dev/null and report ns per message, for:
+ *
+ *   printf   stdio, as the proxy used to log: one lock around stdout
+ *   log      log_info into the thread's ring, drained in the background
+ *
+ * Messages the log drops because its ring is full count as logged, the
+ * same as in the proxy.
+ *
+ * usage: log_bench [messages per thread]
+ */
+#include "csapp.h"
+#include "log.h"
+
+#define THREADS 4
+
+static long msgs;
+static int use_log;
+
+static double now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *worker(void *vargp)
+{
+  long i;
+
+  for (i = 0; i < msgs; i++) {
+    if (use_log)
+      log_info("Accepted connection from (%s, %ld)\n", "localhost", 40000 + i % 20000);
+    else
+      printf("Accepted connection from (%s, %ld)\n", "localhost", 40000 + i % 20000);
+  }
+  return NULL;
+}
+
+static void run(const char *name, int nthreads)
+{
+  pthread_t tid[THREADS];
+  double t;
+  int i;
+
+  t = now_ns();
+  for (i = 0; i < nthreads; i++)
+    Pthread_create(&tid[i], NULL, worker, NULL);
+  for (i = 0; i < nthreads; i++)
+    Pthread_join(tid[i], NULL);
+  t = now_ns() - t;
+  fflush(stdout);
+  fprintf(stderr, "%-7s %d threads %8.1f ns/message\n", name, nthreads,
+          t / (msgs * nthreads));
+}
+
+int main(int argc, char **argv)
+{
+  int fd, n;
+
+  msgs = argc > 1 ? atol(argv[1]) : 200000;
+  // both write to /dev/null, the results go to stderr
+  if ((fd = open("/dev/null", O_WRONLY)) < 0 || dup2(fd, STDOUT_FILENO) < 0)
+    unix_error("/dev/null");
+  log_init(STDOUT_FILENO);
+
+  for (n = 1; n <= THREADS; n *= 2) {
+    use_log = 0;
+    run("printf", n);
+    use_log = 1;
+    run("log", n);
+  }
+  return 0;
+}
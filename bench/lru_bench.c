@@ -0,0 +1,192 @@
+/*
+ * lru_bench.c - hit ratio of the cache's LRU against the old refer_cnt policy
+ *
+ * Replays a trace of "<size> <url>" lines through cache.c (LRU) and through
+ * a model of the policy it replaced: evict the object with the fewest hits,
+ * never aging the counts. Objects over MAX_OBJECT_SIZE are never cached, as
+ * in relay_body.
+ *
+ * Without a trace file a synthetic one is generated: Zipf(0.9) requests
+ * over a fixed set of objects, with the popular set shifting every quarter
+ * of the run. -w writes that trace out so it can be replayed or edited.
+ *
+ * usage: lru_bench [tracefile]
+ *        lru_bench -w tracefile
+ */
+#include "csapp.h"
+#include "cache.h"
+#include "hash.h"
+
+#define GEN_OBJECTS  4000
+#define GEN_REQUESTS 400000
+#define GEN_PHASES   4
+#define ZIPF_S       0.9
+
+typedef struct
+{
+  char *url;
+  int size;
+} req_t;
+
+static req_t *trace;
+static int ntrace, trace_cap;
+
+static void trace_add(const char *url, int size)
+{
+  if (ntrace == trace_cap) {
+    trace_cap = trace_cap ? trace_cap * 2 : 1024;
+    trace = Realloc(trace, trace_cap * sizeof(req_t));
+  }
+  trace[ntrace].url = strdup(url);
+  trace[ntrace].size = size;
+  ntrace++;
+}
+
+static void trace_load(const char *path)
+{
+  FILE *fp = fopen(path, "r");
+  char url[MAXLINE];
+  int size;
+
+  if (fp == NULL)
+    unix_error("fopen error");
+  while (fscanf(fp, "%d %8191s", &size, url) == 2)
+    trace_add(url, size);
+  fclose(fp);
+}
+
+static void trace_generate(void)
+{
+  double *cdf = Malloc(GEN_OBJECTS * sizeof(double)), sum = 0, u;
+  int *sizes = Malloc(GEN_OBJECTS * sizeof(int));
+  char url[MAXLINE];
+  int i, lo, hi, obj;
+
+  srand48(42);
+  for (i = 0; i < GEN_OBJECTS; i++) {
+    cdf[i] = sum += 1.0 / pow(i + 1, ZIPF_S);
+    // mostly small pages, some images up to a few hundred KB
+    sizes[i] = (int)(512 * exp(drand48() * 6.5));
+  }
+
+  for (i = 0; i < GEN_REQUESTS; i++) {
+    u = drand48() * sum;
+    for (lo = 0, hi = GEN_OBJECTS - 1; lo < hi; ) {
+      int mid = (lo + hi) / 2;
+      if (cdf[mid] < u) lo = mid + 1; else hi = mid;
+    }
+    // each phase makes a different set of objects popular
+    obj = (lo + (i / (GEN_REQUESTS / GEN_PHASES)) * (GEN_OBJECTS / 3)) % GEN_OBJECTS;
+    snprintf(url, sizeof(url), "http://origin/obj/%d", obj);
+    trace_add(url, sizes[obj]);
+  }
+  Free(cdf);
+  Free(sizes);
+}
+
+/* The policy before the LRU: fewest hits goes, counts never age. */
+typedef struct
+{
+  char *url;
+  int size, refer_cnt;
+} lfu_obj;
+
+static hash lfu_index;
+static lfu_obj **lfu;
+static int nlfu;
+static size_t lfu_total;
+
+static int lfu_access(req_t *r)
+{
+  pair *p;
+  lfu_obj *o;
+  int i, v;
+
+  if ((p = hash_find(&lfu_index, r->url)) != NULL) {
+    ((lfu_obj *)p->value)->refer_cnt++;
+    return 1;
+  }
+  if (r->size > MAX_OBJECT_SIZE)
+    return 0;
+
+  // charged like cache.c charges, payload slab class only
+  while (slab_size(r->size) > MAX_CACHE_SIZE - lfu_total) {
+    for (v = 0, i = 1; i < nlfu; i++)
+      if (lfu[i]->refer_cnt < lfu[v]->refer_cnt)
+        v = i;
+    lfu_total -= slab_size(lfu[v]->size);
+    hash_erase(&lfu_index, lfu[v]->url);
+    Free(lfu[v]);
+    lfu[v] = lfu[--nlfu];
+  }
+
+  o = Malloc(sizeof(lfu_obj));
+  o->url = r->url;
+  o->size = r->size;
+  o->refer_cnt = 0;
+  hash_insert(&lfu_index, make_pair(r->url, o));
+  lfu = Realloc(lfu, (nlfu + 1) * sizeof(lfu_obj *));
+  lfu[nlfu++] = o;
+  lfu_total += slab_size(r->size);
+  return 0;
+}
+
+static int lru_access(req_t *r)
+{
+  cache_node *node;
+
+  if ((node = search_cache(r->url)) != NULL) {
+    cache_unpin(node);
+    return 1;
+  }
+  if (r->size <= MAX_OBJECT_SIZE)
+    cache_insert(r->url, slab_alloc(r->size), 0, r->size);
+  return 0;
+}
+
+static void run(const char *name, int (*access)(req_t *))
+{
+  long hits = 0;
+  double bytes = 0, hit_bytes = 0;
+  int i;
+
+  for (i = 0; i < ntrace; i++) {
+    bytes += trace[i].size;
+    if (access(&trace[i])) {
+      hits++;
+      hit_bytes += trace[i].size;
+    }
+  }
+
+  printf("%-10s hit ratio %6.2f%%  byte hit ratio %6.2f%%\n",
+         name, 100.0 * hits / ntrace, 100.0 * hit_bytes / bytes);
+}
+
+int main(int argc, char **argv)
+{
+  int i;
+
+  if (argc == 3 && !strcmp(argv[1], "-w")) {
+    FILE *fp;
+
+    trace_generate();
+    if ((fp = fopen(argv[2], "w")) == NULL)
+      unix_error("fopen error");
+    for (i = 0; i < ntrace; i++)
+      fprintf(fp, "%d %s\n", trace[i].size, trace[i].url);
+    fclose(fp);
+    return 0;
+  }
+  if (argc == 2)
+    trace_load(argv[1]);
+  else
+    trace_generate();
+
+  printf("%d requests, cache %d bytes, objects up to %d bytes\n",
+         ntrace, MAX_CACHE_SIZE, MAX_OBJECT_SIZE);
+  hash_init(&lfu_index);
+  init_cache();
+  run("refer_cnt", lfu_access);
+  run("lru", lru_access);
+  return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * parse_bench.c - cost of parsing a request head
+ *
+ * Parses a typical browser request over and over and reports ns per
+ * request for:
+ *
+ *   http       http_parse on the whole head
+ *   http/64    http_parse fed 64 bytes at a time, as a slow client would
+ *   lines      the line-by-line path it replaced: copy each line out of
+ *              the buffer, strstr it for the interesting headers and
+ *              strcat the keepers into a second buffer
+ *
+ * usage: parse_bench [iterations]
+ */
+#include "csapp.h"
+#include "http.h"
+
+static const char request[] =
+    "GET http://www.example.com:8080/images/logo.png?size=large HTTP/1.1\r\n"
+    "Host: www.example.com:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101 Firefox/120.0\r\n"
+    "Accept: image/avif,image/webp,*/*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: http://www.example.com:8080/index.html\r\n"
+    "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark; lang=en\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: no-cache\r\n"
+    "\r\n";
+
+static volatile long sink;
+
+static double now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void run_http(const char *buf, size_t len)
+{
+  http_msg m;
+
+  http_init(&m, 0);
+  if (http_parse(&m, buf, len) <= 0)
+    app_error("parse failed");
+  sink += m.nhdrs + (http_find(&m, "Host") != NULL);
+}
+
+static void run_http64(const char *buf, size_t len)
+{
+  http_msg m;
+  size_t n;
+  int rc = HTTP_AGAIN;
+
+  http_init(&m, 0);
+  for (n = 64; rc == HTTP_AGAIN; n += 64)
+    rc = http_parse(&m, buf, n < len ? n : len);
+  if (rc <= 0)
+    app_error("parse failed");
+  sink += m.nhdrs + (http_find(&m, "Host") != NULL);
+}
+
+/* The old way: rio_readlineb-style copies and strstr per line */
+static void run_lines(const char *buf, size_t len)
+{
+  char line[MAXLINE], header[MAXBUF], host[MAXLINE];
+  char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+  const char *p = buf, *nl;
+  int keep_alive = 0;
+  size_t n;
+
+  nl = memchr(p, '\n', len);
+  n = nl + 1 - p;
+  memcpy(line, p, n);
+  line[n] = '\0';
+  p += n;
+  if (sscanf(line, "%s %s %s", method, uri, version) != 3)
+    app_error("parse failed");
+
+  *header = *host = '\0';
+  do {
+    nl = memchr(p, '\n', buf + len - p);
+    n = nl + 1 - p;
+    memcpy(line, p, n);
+    line[n] = '\0';
+    p += n;
+
+    if (strstr(line, "Host:") != NULL) {
+      strcpy(host, line + 6);
+      *strchr(host, '\r') = '\0';
+    }
+    if (strstr(line, "Connection:")) {
+      keep_alive = strstr(line, "keep-alive") != NULL;
+      continue;
+    }
+    if (strcmp(line, "\r\n"))
+      strcat(header, line);
+  } while (strcmp(line, "\r\n"));
+  sink += keep_alive + strlen(header) + strlen(host);
+}
+
+static void bench(const char *name, void (*fn)(const char *, size_t), long iters)
+{
+  double t;
+  long i;
+
+  for (i = 0; i < iters / 10; i++)       // warm up
+    fn(request, sizeof(request) - 1);
+  t = now_ns();
+  for (i = 0; i < iters; i++)
+    fn(request, sizeof(request) - 1);
+  t = now_ns() - t;
+  printf("%-8s %8.1f ns/request\n", name, t / iters);
+}
+
+int main(int argc, char **argv)
+{
+  long iters = argc > 1 ? atol(argv[1]) : 2000000;
+
+  printf("%zu byte head, %ld iterations\n", sizeof(request) - 1, iters);
+  bench("http", run_http, iters);
+  bench("http/64", run_http64, iters);
+  bench("lines", run_lines, iters);
+  return 0;
+}
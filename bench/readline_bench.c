@@ -0,0 +1,105 @@
+/*
+ * readline_bench.c - rio_readlineb against the byte-at-a-time version
+ *
+ * Reads a file of HTTP header lines through rio_readlineb, once with the
+ * old loop that pulls one byte per rio_read call and once with each line
+ * scanner this CPU has. The file is read from the page cache, so the
+ * numbers are mostly user-space cost per line.
+ *
+ * usage: readline_bench [MB]
+ */
+#include "csapp.h"
+
+static const char *lines[] = {
+    "Host: www.example.com:8080\r\n",
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101 Firefox/120.0\r\n",
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n",
+    "Accept-Language: en-US,en;q=0.5\r\n",
+    "Accept-Encoding: gzip, deflate, br\r\n",
+    "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark; lang=en\r\n",
+    "Connection: keep-alive\r\n",
+    "\r\n",
+};
+
+/* The old rio_readlineb, one rio_readnb call per byte */
+static ssize_t readline_bytewise(rio_t *rp, char *usrbuf, size_t maxlen)
+{
+    int n, rc;
+    char c, *bufp = usrbuf;
+
+    for (n = 1; n < maxlen; n++) {
+	if ((rc = rio_readnb(rp, &c, 1)) == 1) {
+	    *bufp++ = c;
+	    if (c == '\n') {
+		n++;
+		break;
+	    }
+	} else if (rc == 0) {
+	    if (n == 1)
+		return 0;
+	    else
+		break;
+	} else
+	    return -1;
+    }
+    *bufp = 0;
+    return n-1;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void run(const char *name, int fd,
+		ssize_t (*readline)(rio_t *, char *, size_t))
+{
+    char buf[MAXLINE];
+    rio_t rio;
+    long n = 0, bytes = 0;
+    ssize_t rc;
+    double t;
+
+    lseek(fd, 0, SEEK_SET);
+    rio_readinitb(&rio, fd);
+    t = now_ns();
+    while ((rc = readline(&rio, buf, MAXLINE)) > 0) {
+	n++;
+	bytes += rc;
+    }
+    t = now_ns() - t;
+    printf("%-8s %7.1f ns/line %7.2f GB/s\n", name, t / n, bytes / t);
+}
+
+static ssize_t readline_rio(rio_t *rp, char *usrbuf, size_t maxlen)
+{
+    return rio_readlineb(rp, usrbuf, maxlen);
+}
+
+int main(int argc, char **argv)
+{
+    long mb = argc > 1 ? atol(argv[1]) : 64, done = 0;
+    const char *isa[] = {"scalar", "sse2", "avx2"};
+    char path[] = "/tmp/readline_benchXXXXXX";
+    int fd, i;
+
+    if ((fd = mkstemp(path)) < 0)
+	unix_error("mkstemp error");
+    unlink(path);
+    while (done < mb << 20)
+	for (i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+	    Rio_writen(fd, (void *)lines[i], strlen(lines[i]));
+	    done += strlen(lines[i]);
+	}
+
+    printf("%ld MB of header lines\n", mb);
+    run("bytewise", fd, readline_bytewise);
+    for (i = 0; i < 3; i++)
+	if (rio_scan_use(isa[i]) == 0)
+	    run(isa[i], fd, readline_rio);
+    Close(fd);
+    return 0;
+}
@@ -0,0 +1,80 @@
+/*
+ * slab_bench.c - memory held by a churning cache
+ *
+ * A few threads insert objects of mixed sizes (64 bytes to
+ * MAX_OBJECT_SIZE, log-uniform) into the cache, far more than it holds,
+ * so eviction runs all the time. Reports the cache's own byte count
+ * against the process RSS as it goes.
+ *
+ * slab_malloc_bench is the same program with payloads from Malloc
+ * instead of the slab allocator.
+ *
+ * usage: slab_bench [inserts per thread]
+ */
+#include "csapp.h"
+#include "cache.h"
+
+#define THREADS 4
+
+static long inserts;
+
+static long rss_kb(void)
+{
+  char line[256];
+  long kb = -1;
+  FILE *fp = fopen("/proc/self/status", "r");
+
+  if (fp == NULL)
+    return -1;
+  while (fgets(line, sizeof(line), fp))
+    if (sscanf(line, "VmRSS: %ld kB", &kb) == 1)
+      break;
+  fclose(fp);
+  return kb;
+}
+
+static void *worker(void *vargp)
+{
+  unsigned int x = 2463534242u + (long)vargp * 7919;
+  char url[64];
+  size_t size;
+  char *buf;
+  long i;
+
+  for (i = 0; i < inserts; i++) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    size = (size_t)(64 * exp((x % 10000) / 10000.0 * log(MAX_OBJECT_SIZE / 64.0)));
+    snprintf(url, sizeof(url), "http://origin/%ld/%ld", (long)vargp, i);
+    buf = slab_alloc(size);
+    memset(buf, 'x', size);   // the cache fills what it allocates
+    cache_insert(url, buf, 0, size);
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv)
+{
+  pthread_t tid[THREADS];
+  long round, base;
+  slab_stats_t st;
+  int i;
+
+  inserts = argc > 1 ? atol(argv[1]) : 20000;
+  init_cache();
+  base = rss_kb();
+  printf("cache limit %d KB, baseline RSS %ld KB\n", MAX_CACHE_SIZE / 1024, base);
+
+  for (round = 1; round <= 5; round++) {
+    for (i = 0; i < THREADS; i++)
+      Pthread_create(&tid[i], NULL, worker, (void *)(round * THREADS + i));
+    for (i = 0; i < THREADS; i++)
+      Pthread_join(tid[i], NULL);
+    slab_stats(&st);
+    printf("round %ld: %7ld inserts  RSS +%6ld KB  slab pages %4zu KB\n",
+           round, round * THREADS * inserts, rss_kb() - base,
+           st.pages_used * SLAB_PAGE / 1024);
+  }
+  return 0;
+}
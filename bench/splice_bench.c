@@ -0,0 +1,123 @@
+/*
+ * splice_bench.c - CPU cost of relaying a response body, rio vs splice
+ *
+ * A producer thread plays the origin and a consumer thread plays the
+ * client, both over loopback TCP. The relay thread in the middle moves
+ * the bytes either the way do_proxy used to (Rio_readnb into a buffer,
+ * Rio_writen out) or with relay_splice(). Only the relay thread's CPU time
+ * is charged.
+ *
+ * usage: splice_bench [megabytes]
+ */
+#include "csapp.h"
+#include "relay.h"
+
+#define DEFAULT_MB 1024
+
+static size_t total_bytes;
+
+static void *producer(void *vargp)
+{
+  int fd = *(int *)vargp;
+  static char buf[1 << 16];
+  size_t left = total_bytes, n;
+
+  memset(buf, 'x', sizeof(buf));
+  while (left > 0) {
+    n = left < sizeof(buf) ? left : sizeof(buf);
+    Rio_writen(fd, buf, n);
+    left -= n;
+  }
+  Close(fd);
+  return NULL;
+}
+
+static void *consumer(void *vargp)
+{
+  int fd = *(int *)vargp;
+  static char buf[1 << 16];
+
+  while (Read(fd, buf, sizeof(buf)) > 0)
+    ;
+  Close(fd);
+  return NULL;
+}
+
+/* Connected loopback TCP pair: *a is the connecting end, *b the accepted. */
+static void tcp_pair(int *a, int *b)
+{
+  int listenfd;
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  char port[16];
+
+  listenfd = Open_listenfd("0");
+  getsockname(listenfd, (SA *)&addr, &len);
+  snprintf(port, sizeof(port), "%d", ntohs(addr.sin_port));
+  *a = Open_clientfd("localhost", port);
+  *b = Accept(listenfd, NULL, NULL);
+  Close(listenfd);
+}
+
+static double now(clockid_t id)
+{
+  struct timespec ts;
+
+  clock_gettime(id, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(const char *mode)
+{
+  int origin_w, origin_r, client_w, client_r;
+  pthread_t ptid, ctid;
+  double wall, cpu, gb;
+  ssize_t moved = 0, n;
+
+  tcp_pair(&origin_w, &origin_r);
+  tcp_pair(&client_r, &client_w);
+  Pthread_create(&ptid, NULL, producer, &origin_w);
+  Pthread_create(&ctid, NULL, consumer, &client_r);
+
+  wall = now(CLOCK_MONOTONIC);
+  cpu = now(CLOCK_THREAD_CPUTIME_ID);
+
+  if (!strcmp(mode, "rio")) {
+    rio_t rio;
+    char buf[MAXBUF];
+
+    Rio_readinitb(&rio, origin_r);
+    while ((n = Rio_readnb(&rio, buf, sizeof(buf))) > 0) {
+      Rio_writen(client_w, buf, n);
+      moved += n;
+    }
+  }
+  else if ((moved = relay_splice(origin_r, client_w, -1)) < 0) {
+    fprintf(stderr, "splice: %s\n",
+            moved == RELAY_NOSPLICE ? "not supported" : strerror(errno));
+    exit(1);
+  }
+
+  cpu = now(CLOCK_THREAD_CPUTIME_ID) - cpu;
+  wall = now(CLOCK_MONOTONIC) - wall;
+
+  Close(origin_r);
+  Close(client_w);
+  Pthread_join(ptid, NULL);
+  Pthread_join(ctid, NULL);
+
+  gb = moved / 1e9;
+  printf("%-6s %8.2f GB %8.3f s wall %8.3f s cpu %8.1f ms cpu/GB %8.2f GB/s\n",
+         mode, gb, wall, cpu, cpu * 1000 / gb, gb / wall);
+}
+
+int main(int argc, char **argv)
+{
+  size_t mb = argc > 1 ? atol(argv[1]) : DEFAULT_MB;
+
+  total_bytes = mb << 20;
+  Signal(SIGPIPE, SIG_IGN);
+  run("rio");
+  run("splice");
+  return 0;
+}
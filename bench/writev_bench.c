@@ -0,0 +1,146 @@
+/*
+ * writev_bench.c - syscalls and segments per response
+ *
+ * Sends a response made of a cached head, a Connection line and a body
+ * over a loopback TCP connection, ping-pong style as a keep-alive client
+ * would fetch them, and reports per response the write syscalls (from
+ * /proc/thread-self/io), the data segments TCP sent (TCP_INFO) and the
+ * round trip time for:
+ *
+ *   writes   one write per piece, as the proxy used to answer hits
+ *   writev   all pieces in one rio_writev
+ *
+ * With separate writes Nagle holds the small Connection line until the
+ * client's delayed ACK for the head, so a small response waits out the
+ * ACK timer each time; expect "writes" to take tens of milliseconds.
+ *
+ * usage: writev_bench [responses]
+ */
+#include <linux/tcp.h>
+#include "csapp.h"
+
+static const char head[] =
+    "HTTP/1.0 200 OK\r\n"
+    "Server: Tiny Web Server\r\n"
+    "Content-length: %zu\r\n"
+    "Content-type: text/html\r\n";
+static const char conn[] = "Connection: keep-alive\r\n\r\n";
+
+static size_t resp_len;
+
+static double now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static long syscw(void)
+{
+  char line[128];
+  long n = -1;
+  FILE *fp = fopen("/proc/thread-self/io", "r");
+
+  if (fp == NULL)
+    return -1;
+  while (fgets(line, sizeof(line), fp))
+    if (sscanf(line, "syscw: %ld", &n) == 1)
+      break;
+  fclose(fp);
+  return n;
+}
+
+static long segs_out(int fd)
+{
+  struct tcp_info ti;
+  socklen_t len = sizeof(ti);
+
+  if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0)
+    return -1;
+  return ti.tcpi_data_segs_out;
+}
+
+/* The client: read a whole response, ask for the next one */
+static void *client(void *vargp)
+{
+  int fd = *(int *)vargp;
+  char *buf = Malloc(resp_len);
+
+  while (rio_readn(fd, buf, resp_len) == (ssize_t)resp_len)
+    if (rio_writen(fd, "x", 1) < 0)
+      break;
+  Free(buf);
+  Close(fd);
+  return NULL;
+}
+
+static void run(const char *name, int fd, int vectored, char *h, size_t hlen,
+                char *body, size_t blen, long iters)
+{
+  struct iovec iov[3];
+  long w, s, i;
+  double t;
+  char c;
+
+  w = syscw();
+  s = segs_out(fd);
+  t = now_us();
+  for (i = 0; i < iters; i++) {
+    if (!vectored) {
+      Rio_writen(fd, h, hlen);
+      Rio_writen(fd, (char *)conn, sizeof(conn) - 1);
+      Rio_writen(fd, body, blen);
+    }
+    else {
+      iov[0].iov_base = h;
+      iov[0].iov_len = hlen;
+      iov[1].iov_base = (char *)conn;
+      iov[1].iov_len = sizeof(conn) - 1;
+      iov[2].iov_base = body;
+      iov[2].iov_len = blen;
+      Rio_writev(fd, iov, 3);
+    }
+    if (rio_readn(fd, &c, 1) != 1)
+      app_error("client went away");
+  }
+  t = now_us() - t;
+  printf("%7zu  %-7s %6.2f syscalls %6.2f segments %8.1f us\n", blen, name,
+         (double)(syscw() - w) / iters,
+         (double)(segs_out(fd) - s) / iters, t / iters);
+}
+
+int main(int argc, char **argv)
+{
+  static const size_t sizes[] = {512, 16 * 1024, 100 * 1024};
+  long iters = argc > 1 ? atol(argv[1]) : 100;
+  struct sockaddr_in addr;
+  socklen_t alen = sizeof(addr);
+  char h[256], port[16], *body;
+  pthread_t tid;
+  int listenfd, cfd, fd, mode;
+  size_t i, hlen;
+
+  listenfd = Open_listenfd("0");
+  if (getsockname(listenfd, (SA *)&addr, &alen) < 0)
+    unix_error("getsockname error");
+  snprintf(port, sizeof(port), "%d", ntohs(addr.sin_port));
+
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    body = Malloc(sizes[i]);
+    memset(body, 'x', sizes[i]);
+    hlen = snprintf(h, sizeof(h), head, sizes[i]);
+    resp_len = hlen + sizeof(conn) - 1 + sizes[i];
+
+    for (mode = 0; mode < 2; mode++) {
+      cfd = Open_clientfd("127.0.0.1", port);
+      fd = Accept(listenfd, NULL, NULL);
+      Pthread_create(&tid, NULL, client, &cfd);
+      run(mode ? "writev" : "writes", fd, mode, h, hlen, body, sizes[i], iters);
+      Close(fd);
+      Pthread_join(tid, NULL);
+    }
+    Free(body);
+  }
+  return 0;
+}
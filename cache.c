@@ -1,84 +1,323 @@
-#include "sbuf.h"
+/*
+ * cache.c - web object cache
+ *
+ * The cache is split into CACHE_SHARDS shards picked by URI hash, each
+ * with its own lock, index and LRU list, so requests for different URIs
+ * rarely wait on each other. Within a shard, objects are found through a
+ * hash index keyed by the exact request URI and threaded on the LRU list
+ * through their own prev/next pointers: a hit moves the object to the
+ * head and eviction takes the tail, both O(1) with no allocation.
+ *
+ * Readers pin what search_cache returns and unpin it when done. Eviction
+ * only unlinks an object and drops the cache's own reference, so the
+ * memory goes when the last reader lets go and a hit never waits for more
+ * than the lookup itself.
+ *
+ * MAX_CACHE_SIZE bounds all shards together. The byte count is shared,
+ * and an insert that pushes it over evicts the oldest of the shard tails:
+ * every shard publishes when its tail was last used, so eviction is LRU
+ * across the whole cache without taking more than one lock at a time. An object is
+ * charged what it really occupies: its payload's slab class plus the
+ * malloc'd node, URL copies and index pair.
+ */
+#include <malloc.h>
+#include <limits.h>
 #include "cache.h"
+#include "hash.h"
+#include "stats.h"
 
-extern proxy_cache_t pcache;
-sbuf_t sbuf_cache;
+typedef struct cache_shard
+{
+  sem_t mutex;
+  hash index;               // url -> cache_node
+  cache_node *head, *tail;  // LRU list
+  long oldest;              // tail's last use, LONG_MAX when empty
+  char pad[64];             // keep neighbouring locks off one cache line
+} cache_shard_t;
+
+typedef struct proxy_cache
+{
+  size_t total_size;        // all shards, updated atomically
+  cache_shard_t shard[CACHE_SHARDS];
+} proxy_cache_t;
+
+static proxy_cache_t pcache;
+
+static void cache_free(cache_node *node)
+{
+  slab_free(node->data);
+  Free(node->url);
+  Free(node);
+}
+
+void cache_unpin(cache_node *node)
+{
+  if (__atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    cache_free(node);
+}
+
+static cache_shard_t *shard_of(char *url)
+{
+  return &pcache.shard[hasing((unsigned char *)url) % CACHE_SHARDS];
+}
 
 void init_cache()
 {
+  slab_init();
   pcache.total_size = 0;
-  for (size_t i = 0; i < MAX_CACHENODE_SIZE; i++)
-  {
-    pcache.cache[i] = NULL;
+  for (int i = 0; i < CACHE_SHARDS; i++) {
+    cache_shard_t *sp = &pcache.shard[i];
+
+    hash_init(&sp->index);
+    sp->head = sp->tail = NULL;
+    sp->oldest = LONG_MAX;
+    Sem_init(&sp->mutex, 0, 1);
   }
 }
 
 void deinit_cache()
 {
-  for (size_t i = 0; i < MAX_CACHENODE_SIZE; i++)
+  cache_node *node, *next;
+
+  for (int i = 0; i < CACHE_SHARDS; i++)
   {
-    if (pcache.cache[i] == NULL) continue;
-    Free(pcache.cache[i]->data);
-    Free(pcache.cache[i]->url);
+    for (node = pcache.shard[i].head; node; node = next)
+    {
+      next = node->next;
+      cache_unpin(node);
+    }
+    hash_clear(&pcache.shard[i].index);
   }
-  // Free(pcache.cache);
+  init_cache();
 }
 
-// return hit(1) or miss(0)
-int search_cache(char *uri)
+/* Shard lock held. Read without it by cache_oldest. */
+static void lru_publish(cache_shard_t *sp)
 {
-  for (size_t i = 0; i < MAX_CACHENODE_SIZE; i++)
-  {
-    if (pcache.cache[i] == NULL) continue;
-    else if (strcmp(pcache.cache[i]->url, uri)) {
-      pcache.cache[i]->refer_cnt++;
-      return 1;
+  __atomic_store_n(&sp->oldest, sp->tail ? sp->tail->used : LONG_MAX, __ATOMIC_RELAXED);
+}
+
+/* Shard lock held. */
+static void lru_unlink(cache_shard_t *sp, cache_node *node)
+{
+  if (node->prev)
+    node->prev->next = node->next;
+  else
+    sp->head = node->next;
+  if (node->next)
+    node->next->prev = node->prev;
+  else
+    sp->tail = node->prev;
+}
+
+/* Shard lock held. */
+static void lru_push(cache_shard_t *sp, cache_node *node)
+{
+  node->prev = NULL;
+  node->next = sp->head;
+  if (sp->head)
+    sp->head->prev = node;
+  else
+    sp->tail = node;
+  sp->head = node;
+}
+
+// return the object cached for uri pinned, or NULL
+cache_node *search_cache(char *uri)
+{
+  cache_shard_t *sp = shard_of(uri);
+  cache_node *node = NULL;
+  pair *p;
+
+  P(&sp->mutex);
+  if ((p = hash_find(&sp->index, uri)) != NULL) {
+    node = p->value;
+    __atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+    node->used = stats_now();
+    if (node != sp->head) {
+      lru_unlink(sp, node);
+      lru_push(sp, node);
     }
+    lru_publish(sp);        // node may be the tail too, alone in its shard
   }
-  return 0;
+  V(&sp->mutex);
+  return node;
 }
 
-void cache_insert(char *url, void *data, size_t data_size)
+/*
+ * cache_evict - Pop the LRU tail of the shard at sp, unless it is keep.
+ *     Returns the node, whose cache reference the caller now holds, or NULL.
+ */
+static cache_node *cache_evict(cache_shard_t *sp, cache_node *keep)
 {
-  // POLICY : LRU
-  int max = 0, idx = 0;
-  
-  // pass if data_size is bigger than MAX_CACHE_SIZE
-  if (data_size > MAX_CACHE_SIZE) return;
+  cache_node *victim;
 
-  // remove while affordable.
-  while (data_size > MAX_CACHE_SIZE - pcache.total_size)
-  {
-    cache_remove();
+  P(&sp->mutex);
+  if ((victim = sp->tail) != NULL && victim != keep) {
+    hash_erase(&sp->index, victim->url);
+    lru_unlink(sp, victim);
+    lru_publish(sp);
+    __atomic_sub_fetch(&pcache.total_size, victim->charge, __ATOMIC_RELAXED);
   }
+  else
+    victim = NULL;
+  V(&sp->mutex);
+  return victim;
+}
 
-  for (size_t i = 0; i < MAX_CACHENODE_SIZE; i++)
-  {
-    if (pcache.cache[i] != NULL) continue;
+/* The shard whose tail was used longest ago, or NULL if all are empty. */
+static cache_shard_t *cache_oldest(void)
+{
+  cache_shard_t *oldest = NULL;
+  long t, min = LONG_MAX;
 
-    P(&sbuf_cache.slots);
-    P(&sbuf_cache.mutex);
+  for (int i = 0; i < CACHE_SHARDS; i++) {
+    if ((t = __atomic_load_n(&pcache.shard[i].oldest, __ATOMIC_RELAXED)) < min) {
+      min = t;
+      oldest = &pcache.shard[i];
+    }
+  }
+  return oldest;
+}
+
+/*
+ * cache_insert - Cache data, which the cache owns from now on, under url.
+ *     Its first head_len bytes are the response head. Drops it if another
+ *     thread cached url first.
+ */
+void cache_insert(char *url, void *data, size_t head_len, size_t data_size)
+{
+  cache_shard_t *sp = shard_of(url);
+  cache_node *node, *victim;
+  cache_shard_t *oldest;
+  pair *entry;
+
+  if (data_size > MAX_CACHE_SIZE) {
+    slab_free(data);
+    return;
+  }
+
+  node = Malloc(sizeof(cache_node));
+  node->url = strdup(url);
+  node->refs = 1;
+  node->size = data_size;
+  node->head_len = head_len;
+  node->data = data;
+  entry = make_pair(url, node);
+  node->charge = slab_size(data_size) + malloc_usable_size(node) +
+                 malloc_usable_size(node->url) + malloc_usable_size(entry) +
+                 malloc_usable_size(entry->key);
+
+  // counted before it is visible, so evicting it can't wrap the total
+  __atomic_add_fetch(&pcache.total_size, node->charge, __ATOMIC_RELAXED);
 
-    pcache.cache[i]->url = url;
-    pcache.cache[i]->refer_cnt = 0;
-    pcache.cache[i]->size = data_size;
-    pcache.cache[i]->data = data;
-    pcache.total_size += data_size;
-    
-    V(&sbuf_cache.items);
-    V(&sbuf_cache.mutex);
+  P(&sp->mutex);
+  if (hash_find(&sp->index, url) != NULL) {
+    V(&sp->mutex);
+    __atomic_sub_fetch(&pcache.total_size, node->charge, __ATOMIC_RELAXED);
+    Free(entry->key);
+    Free(entry);
+    cache_free(node);
+    return;
+  }
+  hash_insert(&sp->index, entry);
+  node->used = stats_now();
+  lru_push(sp, node);
+  lru_publish(sp);
+  V(&sp->mutex);
+  stats_add(STAT_INSERTS, 1);
 
-    break;
+  // remove the least recently used while over budget; the only object
+  // left may be the new one, which stays
+  while (__atomic_load_n(&pcache.total_size, __ATOMIC_RELAXED) > MAX_CACHE_SIZE &&
+         (oldest = cache_oldest()) != NULL &&
+         (victim = cache_evict(oldest, node)) != NULL) {
+    stats_add(STAT_EVICTIONS, 1);
+    cache_unpin(victim);
   }
 }
 
+/* Bytes charged by all cached objects */
+size_t cache_size(void)
+{
+  return __atomic_load_n(&pcache.total_size, __ATOMIC_RELAXED);
+}
+
 void cache_remove()
 {
-  // POLICY : LRU
-  int min = __INT32_MAX__, idx = 0;
-  P(&sbuf_cache.items);
-  P(&sbuf_cache.mutex);
-  
-  V(&sbuf_cache.mutex);
-  V(&sbuf_cache.slots);
-}
\ No newline at end of file
+  cache_shard_t *oldest = cache_oldest();
+  cache_node *victim;
+
+  if (oldest && (victim = cache_evict(oldest, NULL)) != NULL) {
+    stats_add(STAT_EVICTIONS, 1);
+    cache_unpin(victim);
+  }
+}
+
+/*
+ * cache_obj_start - Start collecting a response whose head (without the
+ *     blank line) is given. body_len < 0: the length is learned at the end.
+ */
+void cache_obj_start(cache_obj_t *o, arena_t *a, const char *head,
+                     size_t head_len, ssize_t body_len)
+{
+  o->buf = NULL;
+  if (body_len > MAX_OBJECT_SIZE)
+    return;
+  o->arena = a;
+  o->sized = body_len >= 0;
+  o->cap = head_len + (o->sized ? body_len : MAXBUF);
+  o->buf = arena_alloc(a, o->cap);
+  memcpy(o->buf, head, head_len);
+  o->len = o->head_len = head_len;
+}
+
+void cache_obj_add(cache_obj_t *o, const void *p, size_t n)
+{
+  if (o->buf == NULL)
+    return;
+  if (o->len - o->head_len + n > MAX_OBJECT_SIZE) {   // too big after all
+    cache_obj_drop(o);
+    return;
+  }
+  if (o->len + n > o->cap) {
+    size_t cap = o->cap * 2 > o->head_len + MAX_OBJECT_SIZE ? o->head_len + MAX_OBJECT_SIZE
+                                                            : o->cap * 2;
+
+    o->buf = arena_grow(o->arena, o->buf, o->cap, cap);
+    o->cap = cap;
+  }
+  memcpy(o->buf + o->len, p, n);
+  o->len += n;
+}
+
+/* The arena takes the buffer back when the request ends. */
+void cache_obj_drop(cache_obj_t *o)
+{
+  o->buf = NULL;
+}
+
+/*
+ * cache_obj_finish - The whole body is in, cache it under url. A body that
+ *     ran to EOF gets a Content-length, so hits can keep the client.
+ */
+void cache_obj_finish(cache_obj_t *o, char *url)
+{
+  char line[64], *obj;
+  size_t body;
+  int n = 0;
+
+  if (o->buf == NULL)
+    return;
+  body = o->len - o->head_len;
+  if (!o->sized)
+    n = snprintf(line, sizeof(line), "Content-length: %zu\r\n", body);
+
+  // one copy of the payload; cache_insert adds the node, URL copy and index pair
+  obj = slab_alloc(o->len + n);
+  memcpy(obj, o->buf, o->head_len);
+  memcpy(obj + o->head_len, line, n);
+  memcpy(obj + o->head_len + n, o->buf + o->head_len, body);
+  cache_insert(url, obj, o->head_len + n, o->len + n);
+  o->buf = NULL;
+}
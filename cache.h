@@ -1,26 +1,57 @@
 #pragma once
 
-#include <stdio.h>
+#include "csapp.h"
+#include "arena.h"
+#include "slab.h"
 
+/* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000  // 1MB
-#define MAX_CACHENODE_SIZE  30
+#define MAX_OBJECT_SIZE 102400  // 100KB
 
+#ifndef CACHE_SHARDS
+#define CACHE_SHARDS 16         // independently locked parts of the cache
+#endif
+
+/*
+ * A cached response: the origin's head minus its Connection headers and
+ * the blank line, then the body. Immutable once cached; only the LRU
+ * links change, under the shard lock.
+ */
 typedef struct cache_t
 {
   int size;
-  int refer_cnt;
+  int charge;                   // bytes counted against MAX_CACHE_SIZE
+  int head_len;
+  int refs;                     // the cache's own plus one per reader
+  long used;                    // last hit or insert, stats_now ns
   char *url;
   void *data;
+  struct cache_t *prev, *next;  // LRU list, most recently used first
 } cache_node;
 
-typedef struct proxy_cache
-{
-  unsigned int total_size;
-  cache_node *cache[MAX_CACHENODE_SIZE];
-} proxy_cache_t;
-
 void init_cache();
 void deinit_cache();
-int search_cache(char *uri);
-void cache_insert(char *url, void *data, size_t data_size);
-void cache_remove();
\ No newline at end of file
+cache_node *search_cache(char *uri);
+void cache_unpin(cache_node *node);
+void cache_insert(char *url, void *data, size_t head_len, size_t data_size);  // data from slab_alloc
+void cache_remove();
+size_t cache_size(void);
+
+/*
+ * Builds a cache object from a response as it is relayed. It is collected
+ * in the request's arena and copied out once, at its final size, if it
+ * makes it into the cache.
+ */
+typedef struct
+{
+  char *buf;                // NULL once the response can't be cached
+  size_t len, cap, head_len;
+  int sized;                // head has a Content-length
+  arena_t *arena;
+} cache_obj_t;
+
+void cache_obj_start(cache_obj_t *o, arena_t *a, const char *head,
+                     size_t head_len, ssize_t body_len);
+void cache_obj_add(cache_obj_t *o, const void *p, size_t n);
+void cache_obj_drop(cache_obj_t *o);
+void cache_obj_finish(cache_obj_t *o, char *url);
@@ -0,0 +1,247 @@
+/*
+ * dns.c - cached, coalesced and optionally asynchronous name resolution
+ *
+ * Every host:port gets one entry. A lookup that finds a fresh answer, or
+ * a failure younger than DNS_NEG_TTL, is served from the entry. Otherwise
+ * the caller is added to the entry's waiters, and only the first one
+ * queues the entry for the resolver threads, so a burst of requests for
+ * one name costs a single getaddrinfo. getaddrinfo doesn't report record
+ * TTLs, so answers are kept for a fixed DNS_TTL.
+ *
+ * Waiters are callbacks run on a resolver thread. dns_resolve waits for
+ * its own callback on a semaphore; the event loops pass one that wakes
+ * the loop instead, so they never block on a lookup.
+ */
+#include "dns.h"
+
+typedef enum { DNS_PENDING, DNS_OK, DNS_FAIL } dns_state;
+
+typedef struct dns_waiter
+{
+  dns_cb cb;
+  void *arg;
+  struct dns_waiter *next;
+} dns_waiter_t;
+
+typedef struct dns_entry
+{
+  char *host, *port;
+  dns_state state;
+  time_t expires;
+  dns_addrs_t addrs;
+  dns_waiter_t *waiters;
+  struct dns_entry *next;       // bucket chain
+  struct dns_entry *next_job;   // resolver queue
+} dns_entry_t;
+
+static dns_entry_t *buckets[DNS_BUCKETS];
+static dns_entry_t *jobs, **jobs_tail = &jobs;
+static sem_t mutex;             // protects everything above
+static sem_t items;             // queued jobs
+
+static unsigned int dns_hash(const char *host, const char *port)
+{
+  unsigned int h = 5381;
+
+  while (*host)
+    h = h * 33 + (unsigned char)*host++;
+  h = h * 33 + ':';
+  while (*port)
+    h = h * 33 + (unsigned char)*port++;
+  return h;
+}
+
+/*
+ * dns_entry - Find the entry for host:port, making one if needed. Expired
+ *     entries met on the way are dropped. Lock held.
+ */
+static dns_entry_t *dns_entry(const char *host, const char *port, time_t now)
+{
+  dns_entry_t **pp = &buckets[dns_hash(host, port) % DNS_BUCKETS];
+  dns_entry_t *e;
+
+  while ((e = *pp) != NULL) {
+    if (!strcmp(e->host, host) && !strcmp(e->port, port))
+      return e;
+    if (e->state != DNS_PENDING && e->expires <= now) {
+      *pp = e->next;
+      Free(e->host);
+      Free(e->port);
+      Free(e);
+      continue;
+    }
+    pp = &e->next;
+  }
+
+  e = Calloc(1, sizeof(dns_entry_t));
+  e->host = strdup(host);
+  e->port = strdup(port);
+  e->state = DNS_FAIL;          // expires = 0: resolved on first use
+  e->next = *pp;
+  *pp = e;
+  return e;
+}
+
+static void dns_lookup(dns_entry_t *e, dns_addrs_t *out)
+{
+  struct addrinfo hints, *listp, *p;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+  out->n = 0;
+  if (getaddrinfo(e->host, e->port, &hints, &listp) != 0)
+    return;
+
+  for (p = listp; p && out->n < DNS_MAX_ADDRS; p = p->ai_next) {
+    dns_addr_t *a = &out->a[out->n++];
+
+    a->family = p->ai_family;
+    a->len = p->ai_addrlen;
+    memcpy(&a->sa, p->ai_addr, p->ai_addrlen);
+  }
+  freeaddrinfo(listp);
+}
+
+static void *dns_thread(void *vargp)
+{
+  dns_entry_t *e;
+  dns_waiter_t *w, *next;
+  dns_addrs_t addrs;
+
+  Pthread_detach(pthread_self());
+  while (1) {
+    P(&items);
+    P(&mutex);
+    e = jobs;
+    if ((jobs = e->next_job) == NULL)
+      jobs_tail = &jobs;
+    V(&mutex);
+
+    dns_lookup(e, &addrs);
+
+    P(&mutex);
+    e->addrs = addrs;
+    e->state = addrs.n ? DNS_OK : DNS_FAIL;
+    e->expires = time(NULL) + (addrs.n ? DNS_TTL : DNS_NEG_TTL);
+    w = e->waiters;
+    e->waiters = NULL;
+    V(&mutex);
+
+    // e may be replaced from here on; the waiters get our copy
+    for (; w; w = next) {
+      next = w->next;
+      w->cb(w->arg, addrs.n ? &addrs : NULL);
+      Free(w);
+    }
+  }
+  return NULL;
+}
+
+void dns_init(void)
+{
+  pthread_t tid;
+  int i;
+
+  Sem_init(&mutex, 0, 1);
+  Sem_init(&items, 0, 0);
+  for (i = 0; i < DNS_THREADS; i++)
+    Pthread_create(&tid, NULL, dns_thread, NULL);
+}
+
+/*
+ * dns_resolve_async - Resolve host:port. Returns 1 with out filled, or -1,
+ *     when the cache already knows the answer. Returns 0 if the lookup is
+ *     in flight; cb(arg, addrs) then runs on a resolver thread when it is
+ *     done, and out is left alone.
+ */
+int dns_resolve_async(const char *host, const char *port, dns_addrs_t *out,
+                      dns_cb cb, void *arg)
+{
+  time_t now = time(NULL);
+  dns_entry_t *e;
+  dns_waiter_t *w;
+
+  P(&mutex);
+  e = dns_entry(host, port, now);
+  if (e->state != DNS_PENDING && e->expires > now) {
+    int ok = e->state == DNS_OK;
+
+    if (ok)
+      *out = e->addrs;
+    V(&mutex);
+    return ok ? 1 : -1;
+  }
+
+  w = Malloc(sizeof(dns_waiter_t));
+  w->cb = cb;
+  w->arg = arg;
+  w->next = e->waiters;
+  e->waiters = w;
+  if (e->state != DNS_PENDING) {    // first one in queues the lookup
+    e->state = DNS_PENDING;
+    e->next_job = NULL;
+    *jobs_tail = e;
+    jobs_tail = &e->next_job;
+    V(&items);
+  }
+  V(&mutex);
+  return 0;
+}
+
+typedef struct
+{
+  sem_t done;
+  dns_addrs_t *out;
+  int ok;
+} dns_sync_t;
+
+static void dns_sync_done(void *arg, const dns_addrs_t *addrs)
+{
+  dns_sync_t *s = arg;
+
+  if ((s->ok = addrs != NULL))
+    *s->out = *addrs;
+  V(&s->done);
+}
+
+/*
+ * dns_resolve - Blocking form of dns_resolve_async. Returns 0, or -1 if
+ *     the name doesn't resolve.
+ */
+int dns_resolve(const char *host, const char *port, dns_addrs_t *out)
+{
+  dns_sync_t s;
+  int rc;
+
+  Sem_init(&s.done, 0, 0);
+  s.out = out;
+  if ((rc = dns_resolve_async(host, port, out, dns_sync_done, &s)) == 0) {
+    P(&s.done);
+    rc = s.ok ? 1 : -1;
+  }
+  sem_destroy(&s.done);
+  return rc > 0 ? 0 : -1;
+}
+
+/*
+ * dns_open_clientfd - open_clientfd over cached addresses. Returns -2 if
+ *     the name doesn't resolve and -1 if no address takes the connection.
+ */
+int dns_open_clientfd(const char *host, const char *port)
+{
+  dns_addrs_t addrs;
+  int i, fd;
+
+  if (dns_resolve(host, port, &addrs) < 0)
+    return -2;
+
+  for (i = 0; i < addrs.n; i++) {
+    if ((fd = socket(addrs.a[i].family, SOCK_STREAM, 0)) < 0)
+      continue;
+    if (connect(fd, (SA *)&addrs.a[i].sa, addrs.a[i].len) == 0)
+      return fd;
+    close(fd);
+  }
+  return -1;
+}
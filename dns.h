@@ -0,0 +1,32 @@
+#pragma once
+
+#include "csapp.h"
+
+/* Name resolution cache in front of getaddrinfo */
+#define DNS_BUCKETS    256
+#define DNS_THREADS    2     // resolver threads
+#define DNS_MAX_ADDRS  8     // addresses kept per name
+#define DNS_TTL        60    // seconds a good answer is trusted
+#define DNS_NEG_TTL    5     // seconds a failed lookup is remembered
+
+typedef struct
+{
+  int family;
+  socklen_t len;
+  struct sockaddr_storage sa;
+} dns_addr_t;
+
+typedef struct
+{
+  int n;
+  dns_addr_t a[DNS_MAX_ADDRS];
+} dns_addrs_t;
+
+/* addrs is NULL if the name did not resolve; it is only valid during the call */
+typedef void (*dns_cb)(void *arg, const dns_addrs_t *addrs);
+
+void dns_init(void);
+int dns_resolve(const char *host, const char *port, dns_addrs_t *out);
+int dns_resolve_async(const char *host, const char *port, dns_addrs_t *out,
+                      dns_cb cb, void *arg);
+int dns_open_clientfd(const char *host, const char *port);
@@ -0,0 +1,984 @@
+/*
+ * event.c - epoll based proxy engine
+ *
+ * Every loop thread owns one epoll instance and the connections it
+ * accepted. The listening socket is shared by all loops and registered
+ * with EPOLLEXCLUSIVE, so a new connection wakes a single loop only.
+ *
+ * A request walks READ_REQ -> CONNECT -> SEND_REQ -> RESP_HEAD -> RELAY.
+ * When the response is complete and the client wants to keep the
+ * connection, it goes back to READ_REQ, picking up any request that was
+ * pipelined behind the last one. All sockets are non-blocking and nothing
+ * in a loop thread blocks: a name not in the DNS cache parks the request
+ * in RESOLVE until a resolver thread posts the answer to the loop's
+ * eventfd.
+ *
+ * Origin connections come from the pool when it has one and go back to it
+ * once a response has been read to its end, so a request can skip CONNECT.
+ * A GET the cache can answer skips the origin altogether: READ_REQ -> HIT
+ * streams the pinned object straight from memory.
+ */
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+#include "event.h"
+#include "proxy.h"
+#include "relay.h"
+#include "pool.h"
+#include "dns.h"
+#include "cache.h"
+#include "arena.h"
+#include "log.h"
+#include "stats.h"
+
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE 0
+#endif
+
+#define EV_RELAY_BURST 16   // reads per wakeup before yielding to others
+#define EV_HEAD_SLACK  64   // room kept in out[] for our Connection header
+#define EV_ARENA_BLOCK (MAX_OBJECT_SIZE + MAXBUF)   // one cacheable response
+
+typedef enum { EV_LISTEN, EV_DNS, EV_CLIENT, EV_UPSTREAM } ev_side;
+
+typedef enum
+{
+  C_READ_REQ,
+  C_RESOLVE,
+  C_CONNECT,
+  C_SEND_REQ,
+  C_RESP_HEAD,
+  C_RELAY,
+  C_HIT,
+  C_DEAD
+} conn_state;
+
+struct conn;
+
+typedef struct ev_ref
+{
+  struct conn *c;
+  ev_side side;
+} ev_ref;
+
+typedef struct conn
+{
+  int fd;                   // client
+  int upfd;                 // origin
+  conn_state state;
+  ev_ref cref;
+  ev_ref uref[2];           // origin refs alternate per origin socket
+  int ugen;
+  struct conn *prev, *next; // loop's connections, swept for timeouts
+  struct conn *next_dead;
+  struct loop *loop;
+  time_t deadline;
+  long t_phase;             // when the phase being timed began, stats_now ns
+
+  int keep_alive;           // client keeps the connection after this response
+  int head_only;            // HEAD request, the response has no body
+  int cache_ok;             // GET, the cache may answer or keep the response
+  cache_node *hit;          // pinned object being sent, from hit_off
+  size_t hit_off;
+  cache_obj_t obj;          // response being collected for the cache
+  arena_t arena;            // request scratch, reset after each response
+  int parked;               // origin muted until the client drains
+  int resp_done;            // last response byte is in out[]
+  ssize_t resp_left;        // body bytes still due, -1: until EOF or last chunk
+  int chunked;              // body framed by chunked encoding, see ck
+  chunk_t ck;
+  int pipe[2];              // uncacheable bodies are spliced through this
+  size_t piped;             // body bytes in the pipe, not yet sent
+  int no_splice;            // the kernel can't splice these sockets
+  int reused;               // upfd came from the pool
+  int origin_keep;          // upfd can go back to the pool afterwards
+  char host[MAXLINE];       // origin, the pool's key
+  char port[16];
+  char key[MAXLINE];        // absolute URI the cache knows the response by
+  size_t head_len;          // client's request head, kept in in[] for retries
+  http_msg req;             // views into in[]
+  http_msg resp;            // views into out[] until rewrite_response
+  dns_addrs_t addrs;        // origin addresses while connecting
+  int next_addr;            // next one to try
+  int dns_pending;          // a resolver thread still holds c
+  int dns_ok;
+  struct conn *next_resolved;
+
+  /* client bytes: current request head and whatever was pipelined after */
+  char in[MAXBUF];
+  size_t in_len;
+
+  /* request for the origin, then the response on its way to the client */
+  char out[MAXBUF];
+  size_t out_len, out_off;
+} conn_t;
+
+typedef struct loop
+{
+  int epfd;
+  int listenfd;
+  ev_ref lref;
+  time_t now;
+  time_t last_sweep;
+  conn_t *conns;
+  conn_t *dead;             // closed this round, freed after the batch
+
+  /* lookups finished by the resolver threads */
+  int evfd;
+  ev_ref eref;
+  sem_t mutex;
+  conn_t *resolved;
+} loop_t;
+
+/*
+ * A batch from epoll_wait may still hold events for an origin socket we
+ * closed and replaced while handling an earlier event of the same batch.
+ * Each origin socket is registered with the ref not used by its
+ * predecessor, so those stale events are recognised and dropped.
+ */
+#define UREF(c) (&(c)->uref[(c)->ugen])
+
+static void conn_close(loop_t *lp, conn_t *c);
+static void try_request(loop_t *lp, conn_t *c);
+static void finish_response(loop_t *lp, conn_t *c);
+
+static void ev_ctl(loop_t *lp, int op, int fd, ev_ref *ref, uint32_t events)
+{
+  struct epoll_event ev;
+
+  ev.events = events;
+  ev.data.ptr = ref;
+  if (epoll_ctl(lp->epfd, op, fd, &ev) < 0)
+    log_error("epoll_ctl(%d, fd %d) error: %s\n", op, fd, strerror(errno));
+}
+
+static int set_nonblock(int fd)
+{
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0) return -1;
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Best effort: a loop should be able to hold tens of thousands of sockets. */
+static void raise_nofile(void)
+{
+  struct rlimit rl;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) < 0) return;
+  rl.rlim_cur = rl.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+/*
+ * ev_connect_next - like open_clientfd, but the socket is non-blocking and
+ *     the connect may still be in progress on return. The addresses not
+ *     tried yet stay in c->addrs in case this one fails.
+ */
+static int ev_connect_next(conn_t *c)
+{
+  dns_addr_t *a;
+  int fd;
+
+  while (c->next_addr < c->addrs.n) {
+    a = &c->addrs.a[c->next_addr++];
+    fd = socket(a->family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) continue;
+    if (connect(fd, (SA *)&a->sa, a->len) == 0 || errno == EINPROGRESS)
+      return fd;
+    close(fd);
+  }
+  return -1;
+}
+
+/* Canned error page; the client may not be reading, so don't insist. */
+static void ev_error(conn_t *c, char *errnum, char *shortmsg)
+{
+  char buf[MAXLINE];
+  int n;
+
+  stats_add(errnum[0] == '5' ? STAT_ERR_5XX : STAT_ERR_4XX, 1);
+  n = snprintf(buf, sizeof(buf),
+               "HTTP/1.0 %s %s\r\n"
+               "Content-type: text/html\r\n"
+               "Connection: close\r\n"
+               "Content-length: %d\r\n\r\n"
+               "%s: %s\r\n",
+               errnum, shortmsg, (int)(strlen(errnum) + strlen(shortmsg) + 4),
+               errnum, shortmsg);
+  if (write(c->fd, buf, n) < 0)
+    return;
+}
+
+/*
+ * build_request - Rewrite the client's parsed request in c->req into a
+ *     request for the origin in c->out. Fills host, port and c->key and
+ *     decides whether the client connection persists. Returns the length of the
+ *     client's head, or -1 if it is malformed.
+ */
+static ssize_t build_request(conn_t *c, char *host, char *port)
+{
+  ssize_t n;
+
+  if ((n = proxy_request(&c->req, c->out, sizeof(c->out), host, port,
+                         c->key, &c->keep_alive)) < 0)
+    return -1;
+  c->out_len = n;
+  c->head_only = http_is(&c->req, c->req.method, "HEAD");
+  c->cache_ok = http_is(&c->req, c->req.method, "GET");
+  return c->req.head_len;
+}
+
+/*
+ * rewrite_response - The response head is complete in c->out. Learn how
+ *     the body is framed, whether the origin keeps the connection, and
+ *     swap its Connection headers for ours. Any body bytes that came with
+ *     the head are moved along.
+ */
+static int rewrite_response(conn_t *c, size_t head_len)
+{
+  char head[MAXBUF];
+  char *p;
+  size_t body = c->out_len - head_len, len;
+  ssize_t n;
+  proxy_resp_t r;
+
+  if ((n = proxy_response(&c->resp, c->head_only, head, sizeof(head), &r)) < 0)
+    return -1;
+  c->resp_left = r.body_len;
+  c->chunked = r.chunked;
+  c->origin_keep = r.origin_keep;
+  chunk_init(&c->ck);
+  // without a length only the origin closing ends the body
+  if (c->resp_left < 0 && !c->chunked)
+    c->keep_alive = c->origin_keep = 0;
+
+  if (c->cache_ok && r.status == 200 && !c->chunked)
+    cache_obj_start(&c->obj, &c->arena, head, n, c->resp_left);
+
+  p = c->keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+  len = strlen(p);
+  if (n + len + body >= sizeof(c->out))
+    return -1;
+  memcpy(head + n, p, len);
+  n += len;
+
+  memmove(c->out + n, c->out + head_len, body);
+  memcpy(c->out, head, n);
+  c->out_len = n + body;
+  c->out_off = 0;
+
+  if (c->chunked) {
+    len = chunk_scan(&c->ck, c->out + n, body);
+    if (len < body)             // junk after the last chunk
+      c->origin_keep = 0;
+    c->out_len = n + len;
+    c->resp_done = c->ck.done;
+  }
+  else if (c->resp_left >= 0) {
+    if (body > c->resp_left) {  // origin sent more than it announced
+      c->out_len -= body - c->resp_left;
+      body = c->resp_left;
+      c->origin_keep = 0;
+    }
+    c->resp_left -= body;
+    c->resp_done = c->resp_left == 0;
+  }
+  cache_obj_add(&c->obj, c->out + n, c->out_len - n);
+  stats_add(STAT_BYTES_ORIGIN, c->out_len - n);
+  return 0;
+}
+
+/*
+ * hit_flush - Send the cached answer: our head in out[], then the body
+ *     straight from the pinned object, both in one writev.
+ */
+static void hit_flush(loop_t *lp, conn_t *c)
+{
+  char *data = c->hit->data;
+  struct iovec iov[2];
+  size_t head;
+  ssize_t n;
+
+  while (c->out_off < c->out_len || c->hit_off < c->hit->size) {
+    iov[0].iov_base = c->out + c->out_off;
+    iov[0].iov_len = c->out_len - c->out_off;
+    iov[1].iov_base = data + c->hit_off;
+    iov[1].iov_len = c->hit->size - c->hit_off;
+    n = writev(c->fd, iov, 2);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN)
+        ev_ctl(lp, EPOLL_CTL_MOD, c->fd, &c->cref, EPOLLOUT);
+      else
+        conn_close(lp, c);
+      return;
+    }
+    head = (size_t)n < iov[0].iov_len ? (size_t)n : iov[0].iov_len;
+    c->out_off += head;
+    c->hit_off += n - head;
+    stats_add(STAT_BYTES_CACHE, n - head);
+  }
+
+  cache_unpin(c->hit);
+  c->hit = NULL;
+  finish_response(lp, c);
+}
+
+/* Answer from the pinned object c->hit. Returns -1 if its head won't fit. */
+static int start_hit(loop_t *lp, conn_t *c)
+{
+  cache_node *node = c->hit;
+  char *p = c->keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+  size_t len = strlen(p);
+
+  if (node->head_len + len > sizeof(c->out)) {
+    cache_unpin(node);
+    c->hit = NULL;
+    return -1;
+  }
+  memcpy(c->out, node->data, node->head_len);
+  memcpy(c->out + node->head_len, p, len);
+  c->out_len = node->head_len + len;
+  c->out_off = 0;
+  c->hit_off = node->head_len;
+  c->state = C_HIT;
+  hit_flush(lp, c);
+  return 0;
+}
+
+static void start_connect(loop_t *lp, conn_t *c)
+{
+  c->next_addr = 0;
+  if ((c->upfd = ev_connect_next(c)) < 0) {
+    ev_error(c, "502", "Bad Gateway");
+    conn_close(lp, c);
+    return;
+  }
+  c->state = C_CONNECT;
+  ev_ctl(lp, EPOLL_CTL_ADD, c->upfd, UREF(c), EPOLLOUT);
+}
+
+/* Resolver thread: hand c back to its loop. */
+static void on_resolved(void *arg, const dns_addrs_t *addrs)
+{
+  conn_t *c = arg;
+  loop_t *lp = c->loop;
+  uint64_t one = 1;
+
+  if ((c->dns_ok = addrs != NULL))
+    c->addrs = *addrs;
+  P(&lp->mutex);
+  c->next_resolved = lp->resolved;
+  lp->resolved = c;
+  V(&lp->mutex);
+  if (write(lp->evfd, &one, sizeof(one)) < 0)
+    return;                 // counter full, the loop is awake anyway
+}
+
+/* Loop thread: continue the requests whose lookups are done. */
+static void on_dns(loop_t *lp)
+{
+  conn_t *c, *next;
+  uint64_t n;
+
+  if (read(lp->evfd, &n, sizeof(n)) < 0)
+    return;
+  P(&lp->mutex);
+  c = lp->resolved;
+  lp->resolved = NULL;
+  V(&lp->mutex);
+
+  for (; c; c = next) {
+    next = c->next_resolved;
+    c->dns_pending = 0;
+    if (c->state == C_DEAD)         // closed while waiting
+      Free(c);
+    else if (c->dns_ok)
+      start_connect(lp, c);
+    else {
+      ev_error(c, "502", "Bad Gateway");
+      conn_close(lp, c);
+    }
+  }
+}
+
+/*
+ * start_request - Send the request at the head of c->in to its origin,
+ *     over a pooled connection if use_pool is set and one is idle.
+ */
+static void start_request(loop_t *lp, conn_t *c, int use_pool)
+{
+  char host[MAXLINE], port[MAXLINE];
+  ssize_t head_len;
+
+  if ((head_len = build_request(c, host, port)) < 0 ||
+      strlen(host) >= sizeof(c->host) || strlen(port) >= sizeof(c->port)) {
+    ev_error(c, "400", "Bad Request");
+    conn_close(lp, c);
+    return;
+  }
+  c->head_len = head_len;
+  strcpy(c->host, host);
+  strcpy(c->port, port);
+
+  c->out_off = 0;
+  c->resp_done = 0;
+  c->parked = 0;
+  ev_ctl(lp, EPOLL_CTL_MOD, c->fd, &c->cref, 0);
+
+  // a cache hit never touches the origin
+  if (c->cache_ok) {
+    if ((c->hit = search_cache(c->key)) != NULL && start_hit(lp, c) == 0) {
+      stats_add(STAT_HITS, 1);
+      return;
+    }
+    if (use_pool)           // a retry is the same miss again
+      stats_add(STAT_MISSES, 1);
+  }
+
+  if (use_pool && (c->upfd = pool_get(host, port)) >= 0) {
+    c->reused = 1;
+    c->state = C_SEND_REQ;
+    ev_ctl(lp, EPOLL_CTL_ADD, c->upfd, UREF(c), EPOLLOUT);
+    return;
+  }
+
+  c->reused = 0;
+  c->state = C_RESOLVE;
+  c->dns_pending = 1;
+  c->t_phase = stats_now();
+  switch (dns_resolve_async(host, port, &c->addrs, on_resolved, c)) {
+  case 0:                   // on_resolved brings c back
+    return;
+  case 1:
+    c->dns_pending = 0;
+    start_connect(lp, c);
+    return;
+  default:
+    c->dns_pending = 0;
+    ev_error(c, "502", "Bad Gateway");
+    conn_close(lp, c);
+  }
+}
+
+/*
+ * upstream_failed - The origin failed before sending anything. A pooled
+ *     connection may just have been closed by the origin while idle, so
+ *     the request is retried once on a fresh one.
+ */
+static void upstream_failed(loop_t *lp, conn_t *c)
+{
+  if (!c->reused) {
+    ev_error(c, "502", "Bad Gateway");
+    conn_close(lp, c);
+    return;
+  }
+  close(c->upfd);
+  c->upfd = -1;
+  c->ugen ^= 1;
+  start_request(lp, c, 0);
+}
+
+/*
+ * try_request - Start the next request if its head is all in. The parser
+ *     picks up where it stopped on the last read.
+ */
+static void try_request(loop_t *lp, conn_t *c)
+{
+  long t = stats_now();
+  int rc = http_parse(&c->req, c->in, c->in_len);
+
+  c->req.parse_ns += stats_now() - t;
+  if (rc > 0) {
+    stats_add(STAT_REQUESTS, 1);
+    stats_time(PH_PARSE, c->req.parse_ns);
+    if (http_is(&c->req, c->req.uri, STATS_PATH)) {
+      stats_serve(c->fd);   // small enough for an empty socket buffer
+      conn_close(lp, c);
+    }
+    else
+      start_request(lp, c, 1);
+  }
+  else if (rc == HTTP_BAD) {
+    ev_error(c, "400", "Bad Request");
+    conn_close(lp, c);
+  }
+  else if (rc == HTTP_TOO_BIG || c->in_len == sizeof(c->in)) {
+    ev_error(c, "431", "Request Header Fields Too Large");
+    conn_close(lp, c);
+  }
+}
+
+static void on_client_read(loop_t *lp, conn_t *c)
+{
+  ssize_t n;
+
+  while (c->state == C_READ_REQ) {
+    n = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN) conn_close(lp, c);
+      return;
+    }
+    if (n == 0) {
+      conn_close(lp, c);
+      return;
+    }
+    c->in_len += n;
+    try_request(lp, c);
+  }
+}
+
+/* The response is out. Go back for the next request, or hang up. */
+static void finish_response(loop_t *lp, conn_t *c)
+{
+  long t = stats_now();
+
+  if (c->upfd >= 0)
+    stats_time(PH_BODY, t - c->t_phase);
+  if (c->obj.buf) {
+    cache_obj_finish(&c->obj, c->key);
+    stats_time(PH_INSERT, stats_now() - t);
+  }
+  arena_reset(&c->arena);
+
+  // no origin at all after a cache hit
+  if (c->upfd >= 0 && c->origin_keep) {
+    ev_ctl(lp, EPOLL_CTL_DEL, c->upfd, NULL, 0);
+    pool_put(c->host, c->port, c->upfd);
+  }
+  else if (c->upfd >= 0)
+    close(c->upfd);
+  c->upfd = -1;
+  c->ugen ^= 1;
+  if (!c->keep_alive) {
+    conn_close(lp, c);
+    return;
+  }
+
+  // drop the head, keep anything pipelined behind it
+  c->in_len -= c->head_len;
+  memmove(c->in, c->in + c->head_len, c->in_len);
+  http_init(&c->req, 0);
+
+  c->state = C_READ_REQ;
+  c->out_len = c->out_off = 0;
+  c->deadline = lp->now + KEEPALIVE_TIMEOUT;
+  ev_ctl(lp, EPOLL_CTL_MOD, c->fd, &c->cref, EPOLLIN);
+  try_request(lp, c);
+}
+
+/* The client is full: mute the origin until it drains. */
+static void relay_park(loop_t *lp, conn_t *c)
+{
+  if (!c->parked) {
+    c->parked = 1;
+    ev_ctl(lp, EPOLL_CTL_MOD, c->upfd, UREF(c), 0);
+    ev_ctl(lp, EPOLL_CTL_MOD, c->fd, &c->cref, EPOLLOUT);
+  }
+}
+
+/*
+ * relay_flush - Push buffered response bytes to the client, out[] first
+ *     and then the pipe. While the client can't take more, the origin is
+ *     muted so neither overflows.
+ */
+static void relay_flush(loop_t *lp, conn_t *c)
+{
+  ssize_t n;
+
+  while (c->out_off < c->out_len) {
+    n = write(c->fd, c->out + c->out_off, c->out_len - c->out_off);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN)
+        conn_close(lp, c);
+      else
+        relay_park(lp, c);
+      return;
+    }
+    c->out_off += n;
+  }
+
+  while (c->piped > 0) {
+    n = relay_splice_nb(c->pipe[0], c->fd, c->piped, !c->resp_done);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN)
+        conn_close(lp, c);
+      else
+        relay_park(lp, c);
+      return;
+    }
+    c->piped -= n;
+  }
+
+  c->out_off = c->out_len = 0;
+  if (c->resp_done) {
+    finish_response(lp, c);
+    return;
+  }
+  if (c->parked) {
+    c->parked = 0;
+    ev_ctl(lp, EPOLL_CTL_MOD, c->fd, &c->cref, 0);
+    ev_ctl(lp, EPOLL_CTL_MOD, c->upfd, UREF(c), EPOLLIN);
+  }
+}
+
+static void on_upstream_write(loop_t *lp, conn_t *c)
+{
+  ssize_t n;
+
+  if (c->state == C_CONNECT) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(c->upfd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+      // try the origin's next address, if it has one
+      close(c->upfd);
+      c->ugen ^= 1;
+      if ((c->upfd = ev_connect_next(c)) < 0) {
+        ev_error(c, "502", "Bad Gateway");
+        conn_close(lp, c);
+        return;
+      }
+      ev_ctl(lp, EPOLL_CTL_ADD, c->upfd, UREF(c), EPOLLOUT);
+      return;
+    }
+    c->state = C_SEND_REQ;
+    stats_time(PH_CONNECT, stats_now() - c->t_phase);
+  }
+
+  while (c->out_off < c->out_len) {
+    n = write(c->upfd, c->out + c->out_off, c->out_len - c->out_off);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) return;
+      upstream_failed(lp, c);
+      return;
+    }
+    c->out_off += n;
+  }
+
+  // Request is out, out[] now collects the response
+  c->state = C_RESP_HEAD;
+  c->t_phase = stats_now();
+  c->out_len = c->out_off = 0;
+  http_init(&c->resp, 1);
+  ev_ctl(lp, EPOLL_CTL_MOD, c->upfd, UREF(c), EPOLLIN);
+}
+
+static void on_response_head(loop_t *lp, conn_t *c)
+{
+  ssize_t n;
+  int rc;
+
+  size_t room = sizeof(c->out) - EV_HEAD_SLACK;
+
+  n = read(c->upfd, c->out + c->out_len, room - c->out_len);
+  if (n < 0 && (errno == EINTR || errno == EAGAIN))
+    return;
+  if (n <= 0) {
+    if (c->out_len == 0)
+      upstream_failed(lp, c);
+    else {
+      ev_error(c, "502", "Bad Gateway");
+      conn_close(lp, c);
+    }
+    return;
+  }
+  c->out_len += n;
+
+  if ((rc = http_parse(&c->resp, c->out, c->out_len)) == HTTP_AGAIN) {
+    if (c->out_len == room) {
+      ev_error(c, "502", "Bad Gateway");
+      conn_close(lp, c);
+    }
+    return;
+  }
+
+  if (rc < 0 || rewrite_response(c, rc) < 0) {
+    ev_error(c, "502", "Bad Gateway");
+    conn_close(lp, c);
+    return;
+  }
+  stats_time(PH_TTFB, stats_now() - c->t_phase);
+  c->t_phase = stats_now();
+  c->state = C_RELAY;
+  relay_flush(lp, c);
+}
+
+/*
+ * relay_in - Take the next body bytes from the origin, at most want.
+ *     While the response may still be cached or is chunked they are read
+ *     into out[]; after that they are spliced into c's pipe and counted
+ *     in c->piped, never entering user space. Returns as read(2).
+ */
+static ssize_t relay_in(conn_t *c, size_t want)
+{
+  ssize_t n;
+
+  if (c->obj.buf == NULL && !c->chunked && !c->no_splice) {
+    if (c->pipe[0] < 0 && relay_pipe_open(c->pipe) < 0)
+      c->no_splice = 1;
+    else {
+      n = relay_splice_nb(c->upfd, c->pipe[1], want > RELAY_CHUNK ? RELAY_CHUNK : want, 1);
+      if (n > 0)
+        c->piped = n;
+      if (n >= 0 || (errno != EINVAL && errno != ENOSYS))
+        return n;
+      c->no_splice = 1;
+    }
+  }
+  return read(c->upfd, c->out, want > sizeof(c->out) ? sizeof(c->out) : want);
+}
+
+static void on_upstream_read(loop_t *lp, conn_t *c)
+{
+  ssize_t n;
+  size_t want;
+  int i;
+
+  for (i = 0; i < EV_RELAY_BURST && c->state == C_RELAY && !c->parked; i++) {
+    want = RELAY_CHUNK;
+    if (c->resp_left >= 0 && c->resp_left < want)
+      want = c->resp_left;
+
+    n = relay_in(c, want);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN) conn_close(lp, c);
+      return;
+    }
+    if (n == 0) {
+      if (c->resp_left > 0 || c->chunked) { // cut short, the client can't trust it
+        conn_close(lp, c);
+        return;
+      }
+      c->resp_done = 1;
+    }
+    else if (c->chunked) {
+      size_t m = chunk_scan(&c->ck, c->out, n);
+
+      if (m < n)                // junk after the last chunk
+        c->origin_keep = 0;
+      n = m;
+      c->resp_done = c->ck.done;
+    }
+    else if (c->resp_left >= 0) {
+      c->resp_left -= n;
+      c->resp_done = c->resp_left == 0;
+    }
+    stats_add(STAT_BYTES_ORIGIN, n);
+    if (c->piped == 0) {
+      cache_obj_add(&c->obj, c->out, n);
+      c->out_len = n;
+      c->out_off = 0;
+    }
+    relay_flush(lp, c);
+  }
+}
+
+static void on_accept(loop_t *lp)
+{
+  int fd, one = 1;
+  conn_t *c;
+
+  while (1) {
+    fd = accept(lp->listenfd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      if (errno != EAGAIN)
+        log_error("accept error: %s\n", strerror(errno));
+      return;
+    }
+    if (set_nonblock(fd) < 0) {
+      close(fd);
+      continue;
+    }
+    // relayed pieces must not wait for the client's delayed ACK
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    c = Calloc(1, sizeof(conn_t));
+    c->fd = fd;
+    http_init(&c->req, 0);
+    arena_init(&c->arena, EV_ARENA_BLOCK);
+    c->upfd = -1;
+    c->pipe[0] = c->pipe[1] = -1;
+    c->loop = lp;
+    c->state = C_READ_REQ;
+    c->cref = (ev_ref){c, EV_CLIENT};
+    c->uref[0] = c->uref[1] = (ev_ref){c, EV_UPSTREAM};
+    c->deadline = lp->now + KEEPALIVE_TIMEOUT;
+
+    c->next = lp->conns;
+    if (lp->conns)
+      lp->conns->prev = c;
+    lp->conns = c;
+
+    ev_ctl(lp, EPOLL_CTL_ADD, fd, &c->cref, EPOLLIN);
+    stats_add(STAT_ACCEPTED, 1);
+  }
+}
+
+static void conn_close(loop_t *lp, conn_t *c)
+{
+  if (c->state == C_DEAD) return;
+
+  close(c->fd);
+  if (c->upfd >= 0)
+    close(c->upfd);
+  if (c->pipe[0] >= 0) {
+    close(c->pipe[0]);
+    close(c->pipe[1]);
+  }
+  if (c->hit)
+    cache_unpin(c->hit);
+  cache_obj_drop(&c->obj);
+  arena_free(&c->arena);
+  c->state = C_DEAD;
+  stats_add(STAT_CLOSED, 1);
+
+  if (c->prev)
+    c->prev->next = c->next;
+  else
+    lp->conns = c->next;
+  if (c->next)
+    c->next->prev = c->prev;
+
+  // a pending lookup still points at c; on_dns frees it
+  if (c->dns_pending)
+    return;
+  c->next_dead = lp->dead;
+  lp->dead = c;
+}
+
+/* Close connections that made no progress before their deadline. */
+static void sweep_timeouts(loop_t *lp)
+{
+  conn_t *c, *next;
+
+  if (lp->now == lp->last_sweep)
+    return;
+  lp->last_sweep = lp->now;
+
+  for (c = lp->conns; c; c = next) {
+    next = c->next;
+    if (c->deadline <= lp->now) {
+      stats_add(STAT_TIMEOUTS, 1);
+      conn_close(lp, c);
+    }
+  }
+}
+
+static void ev_dispatch(loop_t *lp, ev_ref *ref, uint32_t events)
+{
+  conn_t *c = ref->c;
+
+  if (ref->side == EV_LISTEN) {
+    on_accept(lp);
+    return;
+  }
+  if (ref->side == EV_DNS) {
+    on_dns(lp);
+    return;
+  }
+  if (c->state == C_DEAD)   // closed earlier in this batch
+    return;
+  if (ref->side == EV_UPSTREAM && ref != UREF(c))
+    return;
+  c->deadline = lp->now + IO_TIMEOUT;
+
+  if (ref->side == EV_CLIENT) {
+    if (c->state == C_READ_REQ)
+      on_client_read(lp, c);
+    else if (events & EPOLLERR)
+      conn_close(lp, c);
+    else if (c->state == C_RELAY && (events & EPOLLOUT))
+      relay_flush(lp, c);
+    else if (c->state == C_HIT && (events & EPOLLOUT))
+      hit_flush(lp, c);
+    else if (events & EPOLLHUP)
+      conn_close(lp, c);
+    return;
+  }
+
+  switch (c->state) {
+  case C_CONNECT:
+  case C_SEND_REQ:
+    on_upstream_write(lp, c);
+    break;
+  case C_RESP_HEAD:
+    on_response_head(lp, c);
+    break;
+  case C_RELAY:
+    on_upstream_read(lp, c);
+    break;
+  default:
+    break;
+  }
+}
+
+static void *event_loop(void *vargp)
+{
+  loop_t *lp = vargp;
+  struct epoll_event events[EV_MAXEVENTS];
+  int i, n;
+
+  while (1) {
+    n = epoll_wait(lp->epfd, events, EV_MAXEVENTS, 1000);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      unix_error("epoll_wait error");
+    }
+    lp->now = time(NULL);
+
+    for (i = 0; i < n; i++)
+      ev_dispatch(lp, events[i].data.ptr, events[i].events);
+    sweep_timeouts(lp);
+
+    while (lp->dead) {
+      conn_t *c = lp->dead;
+      lp->dead = c->next_dead;
+      Free(c);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * event_run - Serve listenfd with nthreads event loops. Never returns.
+ */
+void event_run(int listenfd, int nthreads)
+{
+  pthread_t tid;
+  loop_t *loops;
+  int i;
+
+  raise_nofile();
+  if (set_nonblock(listenfd) < 0)
+    unix_error("fcntl error");
+
+  loops = Calloc(nthreads, sizeof(loop_t));
+  for (i = 0; i < nthreads; i++) {
+    loop_t *lp = &loops[i];
+
+    if ((lp->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+      unix_error("epoll_create1 error");
+    lp->listenfd = listenfd;
+    lp->lref = (ev_ref){NULL, EV_LISTEN};
+    lp->now = time(NULL);
+    ev_ctl(lp, EPOLL_CTL_ADD, listenfd, &lp->lref, EPOLLIN | EPOLLEXCLUSIVE);
+
+    if ((lp->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+      unix_error("eventfd error");
+    lp->eref = (ev_ref){NULL, EV_DNS};
+    Sem_init(&lp->mutex, 0, 1);
+    ev_ctl(lp, EPOLL_CTL_ADD, lp->evfd, &lp->eref, EPOLLIN);
+  }
+
+  for (i = 1; i < nthreads; i++)
+    Pthread_create(&tid, NULL, event_loop, &loops[i]);
+  event_loop(&loops[0]);
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "csapp.h"
+
+/* epoll engine */
+#define EV_THREADS    4     // event loop threads
+#define EV_MAXEVENTS  256   // events per epoll_wait
+
+void event_run(int listenfd, int nthreads);
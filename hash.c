@@ -1,6 +1,14 @@
+/*
+ * hash.c - open addressing string table with linear probing
+ *
+ * Erased keys leave a DELETED tombstone so probes for keys past them keep
+ * going. Tombstones count toward the load factor, and a rehash drops them.
+ */
 #include "hash.h"
 
-pair* make_pair(char* key, int value)
+static void re_allocate(hash* hash, int size);
+
+pair* make_pair(char* key, void* value)
 {
 	pair* new_pair = (pair*)malloc(sizeof(pair));
 
@@ -10,14 +18,15 @@ pair* make_pair(char* key, int value)
 	return new_pair;
 }
 
-void initialize(hash* hash)
+void hash_init(hash* hash)
 {
 	hash->bucket = NULL;
 	hash->capacity = 0;
 	hash->size = 0;
+	hash->deleted = 0;
 }
 
-static unsigned int hasing(unsigned char *str)
+unsigned int hasing(unsigned char *str)
 {
 	unsigned int hash = 5381;
 
@@ -29,24 +38,59 @@ static unsigned int hasing(unsigned char *str)
 	return hash;
 }
 
-void insert(hash* hash, pair* data)
+static int is_prime(int n)
+{
+	if (n < 2)
+		return 0;
+	for (int d = 2; d * d <= n; ++d)
+		if (n % d == 0)
+			return 0;
+	return 1;
+}
+
+static int get_next_prime(int n)
+{
+	while (!is_prime(n))
+		++n;
+	return n;
+}
+
+/*
+ * hash_insert - Add data, which the table owns from now on. Returns -1 and
+ *     leaves the table alone if the key is already there.
+ */
+int hash_insert(hash* hash, pair* data)
 {
 	if (hash->capacity == 0
-		|| (double)hash->size / hash->capacity > MAX_LOAD_FACTOR)
-		re_allocate(hash, hash->capacity * 2);
-	
+		|| (double)(hash->size + hash->deleted + 1) / hash->capacity > MAX_LOAD_FACTOR)
+		re_allocate(hash, (hash->size + 1) * 4);
+
 	unsigned int hash_value = hasing((unsigned char*)data->key);
 	unsigned int idx = hash_value;
+	int tomb = -1;
 
-	while (hash->bucket[idx % hash->capacity].state == USED)
+	while (hash->bucket[idx % hash->capacity].state != EMPTY)
 	{
-		if (strcmp(hash->bucket[idx % hash->capacity].data->key, data->key) == 0)
-			return;
+		node* n = &hash->bucket[idx % hash->capacity];
+
+		if (n->state == DELETED)
+		{
+			if (tomb < 0)
+				tomb = idx % hash->capacity;
+		}
+		else if (n->hash_value == hash_value && strcmp(n->data->key, data->key) == 0)
+			return -1;
 		++idx;
 	}
 
+	if (tomb >= 0)
+	{
+		idx = tomb;
+		--hash->deleted;
+	}
 	hash->bucket[idx % hash->capacity] = (node){data, hash_value, USED};
 	++hash->size;
+	return 0;
 }
 
 static int find_idx(hash* hash, char* key)
@@ -56,17 +100,20 @@ static int find_idx(hash* hash, char* key)
 
 	for (int i = 0; i < hash->capacity; ++i, ++idx)
 	{
-		if (hash->bucket[idx % hash->capacity].state == EMPTY)
+		node* n = &hash->bucket[idx % hash->capacity];
+
+		if (n->state == EMPTY)
 			break;
-		if (hash->bucket[idx % hash->capacity].state == DELETED)
+		if (n->state == DELETED)
 			continue;
-		if (strcmp(hash->bucket[idx % hash->capacity].data->key, key) == 0)
+		if (n->hash_value == hash_value && strcmp(n->data->key, key) == 0)
 			return idx % hash->capacity;
 	}
 	return -1;
 }
 
-void erase(hash* hash, char* key)
+/* hash_erase - Drop key and free its pair; the value is the caller's. */
+void hash_erase(hash* hash, char* key)
 {
 	int idx = find_idx(hash, key);
 	if (idx == -1)
@@ -76,9 +123,10 @@ void erase(hash* hash, char* key)
 	free(hash->bucket[idx].data);
 	hash->bucket[idx].state = DELETED;
 	--hash->size;
+	++hash->deleted;
 }
 
-pair* find(hash* hash, char* key)
+pair* hash_find(hash* hash, char* key)
 {
 	int idx = find_idx(hash, key);
 	if (idx == -1)
@@ -87,7 +135,7 @@ pair* find(hash* hash, char* key)
 	return hash->bucket[idx].data;
 }
 
-void clear(hash* hash)
+void hash_clear(hash* hash)
 {
 	for (int i = 0; i < hash->capacity; ++i)
 	{
@@ -98,14 +146,14 @@ void clear(hash* hash)
 		}
 	}
 	free(hash->bucket);
-	initialize(hash);
+	hash_init(hash);
 }
 
 static void re_allocate(hash* hash, int size)
 {
 	int prev_capacity = hash->capacity;
 
-	if (size == 0)
+	if (size < INITIAL_CAPACITY)
 		hash->capacity = INITIAL_CAPACITY;
 	else
 		hash->capacity = get_next_prime(size);
@@ -121,15 +169,12 @@ static void re_allocate(hash* hash, int size)
 		unsigned int idx = hash->bucket[i].hash_value;
 
 		while (new_bucket[idx % hash->capacity].state == USED)
-		{
-			if (strcmp(new_bucket[idx % hash->capacity].data->key, hash->bucket[i].data->key) == 0)
-				return;
 			++idx;
-		}
 
 		new_bucket[idx % hash->capacity] =
 			(node){hash->bucket[i].data, hash->bucket[i].hash_value, USED};
 	}
 	free(hash->bucket);
 	hash->bucket = new_bucket;
-}
\ No newline at end of file
+	hash->deleted = 0;
+}
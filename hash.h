@@ -1,4 +1,7 @@
-#include <stdio.h>
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
 
 #define INITIAL_CAPACITY 7
 #define MAX_LOAD_FACTOR 0.5
@@ -6,7 +9,7 @@
 typedef struct pair
 {
 	char* key;
-	int value;
+	void* value;
 } pair;
 
 typedef enum state
@@ -27,5 +30,14 @@ typedef struct hash
 {
 	node* bucket;
 	int size;
+	int deleted;	// tombstones, they lengthen probes like live keys
 	int capacity;
-} hash;
\ No newline at end of file
+} hash;
+
+unsigned int hasing(unsigned char *str);
+pair* make_pair(char* key, void* value);
+void hash_init(hash* hash);
+int hash_insert(hash* hash, pair* data);
+void hash_erase(hash* hash, char* key);
+pair* hash_find(hash* hash, char* key);
+void hash_clear(hash* hash);
@@ -0,0 +1,232 @@
+/*
+ * http.c - incremental HTTP/1.x head parser
+ *
+ * http_parse tokenizes a request or response head in place: the request
+ * or status line and every header come out as views into the caller's
+ * buffer, nothing is copied. It may be called again whenever more bytes
+ * arrive and carries on from the last line end it found, so each byte is
+ * looked at once. Views are offsets, so the caller may move the buffer
+ * between calls as long as the bytes keep their order.
+ *
+ * http_read and http_consume run the parser over a rio buffer for the
+ * blocking engine.
+ */
+#include "http.h"
+#include "stats.h"
+
+void http_init(http_msg *m, int response)
+{
+  m->response = response;
+  m->base = NULL;
+  m->scan = m->line = 0;
+  m->nlines = 0;
+  m->status = 0;
+  m->nhdrs = 0;
+  m->head_len = 0;
+  m->parse_ns = 0;
+}
+
+static http_str view(size_t from, size_t to)
+{
+  return (http_str){from, to - from};
+}
+
+/* [from, to) up to the next space, which is skipped. -1 if there is none. */
+static ssize_t word(const char *s, size_t from, size_t to, http_str *out)
+{
+  const char *sp = memchr(s + from, ' ', to - from);
+
+  if (sp == NULL)
+    return -1;
+  *out = view(from, sp - s);
+  return sp - s + 1;
+}
+
+static int parse_first(http_msg *m, const char *s, size_t from, size_t to)
+{
+  ssize_t p;
+
+  if (!m->response) {
+    // method SP uri SP version
+    if ((p = word(s, from, to, &m->method)) < 0 ||
+        (p = word(s, p, to, &m->uri)) < 0)
+      return HTTP_BAD;
+    m->version = view(p, to);
+    if (!m->method.len || !m->uri.len || m->version.len < 8 ||
+        strncmp(s + p, "HTTP/", 5))
+      return HTTP_BAD;
+    return 0;
+  }
+
+  // version SP status [SP reason]
+  if ((p = word(s, from, to, &m->version)) < 0 || m->version.len < 8 ||
+      strncmp(s + from, "HTTP/", 5) || to - p < 3)
+    return HTTP_BAD;
+  if (!isdigit(s[p]) || !isdigit(s[p + 1]) || !isdigit(s[p + 2]) ||
+      (to - p > 3 && s[p + 3] != ' '))
+    return HTTP_BAD;
+  m->status = (s[p] - '0') * 100 + (s[p + 1] - '0') * 10 + (s[p + 2] - '0');
+  m->reason = to - p > 3 ? view(p + 4, to) : view(to, to);
+  return 0;
+}
+
+static int parse_header(http_msg *m, const char *s, size_t from, size_t to)
+{
+  const char *colon;
+  size_t name_end, v;
+  http_hdr *h;
+
+  // obsolete line folding is not supported
+  if (s[from] == ' ' || s[from] == '\t')
+    return HTTP_BAD;
+  if ((colon = memchr(s + from, ':', to - from)) == NULL)
+    return HTTP_BAD;
+  name_end = colon - s;
+  if (name_end == from || s[name_end - 1] == ' ' || s[name_end - 1] == '\t')
+    return HTTP_BAD;
+  if (m->nhdrs == HTTP_MAX_HDRS)
+    return HTTP_TOO_BIG;
+
+  for (v = name_end + 1; v < to && (s[v] == ' ' || s[v] == '\t'); v++)
+    ;
+  while (to > v && (s[to - 1] == ' ' || s[to - 1] == '\t'))
+    to--;
+
+  h = &m->hdrs[m->nhdrs++];
+  h->name = view(from, name_end);
+  h->value = view(v, to);
+  return 0;
+}
+
+/*
+ * http_parse - Carry on parsing the head at the front of buf, which holds
+ *     len bytes and starts with whatever earlier calls saw. Returns the
+ *     head's length once its blank line is in, HTTP_AGAIN if it isn't yet,
+ *     or HTTP_BAD / HTTP_TOO_BIG.
+ */
+int http_parse(http_msg *m, const char *buf, size_t len)
+{
+  const char *nl;
+  size_t end, next;
+  int rc;
+
+  m->base = buf;
+  while (1) {
+    if ((nl = memchr(buf + m->scan, '\n', len - m->scan)) == NULL) {
+      m->scan = len;
+      return len >= HTTP_MAX_HEAD ? HTTP_TOO_BIG : HTTP_AGAIN;
+    }
+    next = nl - buf + 1;
+    if (next > HTTP_MAX_HEAD)
+      return HTTP_TOO_BIG;
+    end = next - 1;
+    if (end > m->line && buf[end - 1] == '\r')
+      end--;
+
+    if (end == m->line) {
+      if (m->nlines > 0) {
+        m->head_len = next;
+        return next;
+      }
+      // stray CRLF before a request line may be ignored
+    }
+    else {
+      rc = m->nlines == 0 ? parse_first(m, buf, m->line, end)
+                          : parse_header(m, buf, m->line, end);
+      if (rc < 0)
+        return rc;
+      m->nlines++;
+    }
+    m->line = m->scan = next;
+  }
+}
+
+/* http_is - Does s equal lit, ignoring case? */
+int http_is(http_msg *m, http_str s, const char *lit)
+{
+  return strlen(lit) == s.len && !strncasecmp(HTTP_P(m, s), lit, s.len);
+}
+
+/* http_find - The first header called name, or NULL. */
+http_hdr *http_find(http_msg *m, const char *name)
+{
+  int i;
+
+  for (i = 0; i < m->nhdrs; i++)
+    if (http_is(m, m->hdrs[i].name, name))
+      return &m->hdrs[i];
+  return NULL;
+}
+
+/* http_has_token - Is tok one of the comma separated elements of s? */
+int http_has_token(http_msg *m, http_str s, const char *tok)
+{
+  const char *p = HTTP_P(m, s), *end = p + s.len, *e;
+  size_t n = strlen(tok);
+
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+      p++;
+    for (e = p; e < end && *e != ','; e++)
+      ;
+    while (e > p && (e[-1] == ' ' || e[-1] == '\t'))
+      e--;
+    if ((size_t)(e - p) == n && !strncasecmp(p, tok, n))
+      return 1;
+    for (p = e; p < end && *p != ','; p++)
+      ;
+  }
+  return 0;
+}
+
+/* http_copy - s as a C string in dst. -1 if it doesn't fit. */
+int http_copy(http_msg *m, http_str s, char *dst, size_t size)
+{
+  if (s.len >= size)
+    return -1;
+  memcpy(dst, HTTP_P(m, s), s.len);
+  dst[s.len] = '\0';
+  return 0;
+}
+
+/*
+ * http_read - Parse the head at the front of rp's buffer, reading more
+ *     into it as needed. On success the views point into rp's buffer until
+ *     http_consume. Returns as http_parse; HTTP_AGAIN means the connection
+ *     ended or failed first.
+ */
+int http_read(rio_t *rp, http_msg *m)
+{
+  ssize_t n;
+  long t;
+  int rc;
+
+  while (1) {
+    // only the parsing is timed, not the waits for more bytes
+    t = stats_now();
+    rc = http_parse(m, rp->rio_bufptr, rp->rio_cnt);
+    m->parse_ns += stats_now() - t;
+    if (rc != HTTP_AGAIN)
+      break;
+
+    // the head has to be contiguous: move the partial one to the front
+    if (rp->rio_bufptr != rp->rio_buf) {
+      memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+      rp->rio_bufptr = rp->rio_buf;
+    }
+    n = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt, RIO_BUFSIZE - rp->rio_cnt);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return HTTP_AGAIN;
+    rp->rio_cnt += n;
+  }
+  return rc;
+}
+
+/* http_consume - Drop the head http_read parsed, keep what follows it. */
+void http_consume(rio_t *rp, http_msg *m)
+{
+  rp->rio_bufptr += m->head_len;
+  rp->rio_cnt -= m->head_len;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "csapp.h"
+
+/* Incremental HTTP/1.x head parser */
+#define HTTP_MAX_HEAD  RIO_BUFSIZE  // request or status line plus headers
+#define HTTP_MAX_HDRS  64
+
+#define HTTP_AGAIN    0     // head not complete yet, call again with more
+#define HTTP_BAD     -1     // malformed
+#define HTTP_TOO_BIG -2     // over HTTP_MAX_HEAD or HTTP_MAX_HDRS
+
+/* A view into the parsed buffer, as an offset so the buffer may move */
+typedef struct
+{
+  size_t off, len;
+} http_str;
+
+typedef struct
+{
+  http_str name, value;
+} http_hdr;
+
+typedef struct
+{
+  int response;             // status line instead of request line
+  const char *base;         // buffer of the last http_parse call
+  size_t scan;              // bytes searched for a line end so far
+  size_t line;              // start of the line being read
+  int nlines;
+
+  http_str method, uri, version;  // request line
+  int status;                     // status line: version, status, reason
+  http_str reason;
+  http_hdr hdrs[HTTP_MAX_HDRS];
+  int nhdrs;
+  size_t head_len;          // including the blank line, once complete
+  long parse_ns;            // time spent in http_parse, if the caller adds it up
+} http_msg;
+
+#define HTTP_P(m, s) ((m)->base + (s).off)
+
+void http_init(http_msg *m, int response);
+int http_parse(http_msg *m, const char *buf, size_t len);
+http_hdr *http_find(http_msg *m, const char *name);
+int http_is(http_msg *m, http_str s, const char *lit);
+int http_has_token(http_msg *m, http_str s, const char *tok);
+int http_copy(http_msg *m, http_str s, char *dst, size_t size);
+int http_read(rio_t *rp, http_msg *m);
+void http_consume(rio_t *rp, http_msg *m);
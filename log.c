@@ -0,0 +1,172 @@
+/*
+ * log.c - asynchronous logger
+ *
+ * Each thread that logs gets its own ring of LOG_RING bytes, registered
+ * once on its first message. log_write formats into the ring and moves
+ * the ring's head; a single drainer thread copies everything between
+ * tail and head of every ring to the log descriptor and moves the tail.
+ * One producer and one consumer per ring, so the only synchronization
+ * is acquire/release on the two indexes: a worker never waits for the
+ * terminal, a lock or another worker. A message that doesn't fit is
+ * dropped and counted, and the drainer reports the count.
+ *
+ * Messages from one thread come out in order; between threads the order
+ * is only roughly by time. log_flush drains synchronously, for exit.
+ */
+#include "log.h"
+
+#define LOG_IDLE_US 1000    // drainer's nap when every ring is empty
+
+typedef struct log_ring
+{
+  size_t head;              // written by the owner
+  char pad1[64];
+  size_t tail;              // written by the drainer
+  char pad2[64];
+  long dropped;             // by the owner
+  long reported;            // by the drainer
+  struct log_ring *next;
+  char buf[LOG_RING];
+} log_ring;
+
+int log_level = LOG_INFO;
+static int log_fd = -1;
+static log_ring *rings;     // all rings, pushed at registration
+static sem_t mutex;         // registration and draining
+static __thread log_ring *my_ring;
+
+static const char *names[] = {"error", "warn", "info", "debug"};
+
+/* log_parse_level - "error", "warn", "info", "debug" or 0-3; -1 if neither */
+int log_parse_level(const char *name)
+{
+  int i;
+
+  for (i = 0; i <= LOG_DEBUG; i++)
+    if (!strcasecmp(name, names[i]) || (name[0] == '0' + i && !name[1]))
+      return i;
+  return -1;
+}
+
+static void put(log_ring *r, size_t at, const char *p, size_t n)
+{
+  size_t off = at % LOG_RING, first = LOG_RING - off;
+
+  if (first > n)
+    first = n;
+  memcpy(r->buf + off, p, first);
+  memcpy(r->buf, p + first, n - first);
+}
+
+static log_ring *ring_of_thread(void)
+{
+  log_ring *r = my_ring;
+
+  if (r == NULL) {
+    r = Calloc(1, sizeof(log_ring));
+    P(&mutex);
+    r->next = rings;
+    rings = r;
+    V(&mutex);
+    my_ring = r;
+  }
+  return r;
+}
+
+void log_write(int level, const char *fmt, ...)
+{
+  char msg[LOG_MAX_MSG];
+  log_ring *r;
+  va_list ap;
+  size_t head, tail;
+  int n;
+
+  if (log_fd < 0)
+    return;
+  va_start(ap, fmt);
+  n = vsnprintf(msg, sizeof(msg), fmt, ap);
+  va_end(ap);
+  if (n < 0)
+    return;
+  if (n >= (int)sizeof(msg))
+    n = sizeof(msg) - 1;
+
+  r = ring_of_thread();
+  head = r->head;
+  tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+  if (LOG_RING - (head - tail) < (size_t)n) {
+    __atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  put(r, head, msg, n);
+  __atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+}
+
+/* Mutex held. Write out what r holds; whether there was anything. */
+static int drain(log_ring *r)
+{
+  size_t tail = r->tail, head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  size_t off, n;
+  long dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+  char note[64];
+
+  if (dropped != r->reported) {
+    n = snprintf(note, sizeof(note), "[log: %ld messages dropped]\n",
+                 dropped - r->reported);
+    rio_writen(log_fd, note, n);
+    r->reported = dropped;
+  }
+  if (head == tail)
+    return 0;
+  while (tail != head) {
+    off = tail % LOG_RING;
+    n = head - tail < LOG_RING - off ? head - tail : LOG_RING - off;
+    if (rio_writen(log_fd, r->buf + off, n) < 0)
+      break;                // nowhere to log to; drop it
+    tail += n;
+  }
+  __atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/* log_flush - Write out everything logged so far. */
+void log_flush(void)
+{
+  log_ring *r;
+
+  P(&mutex);
+  for (r = rings; r != NULL; r = r->next)
+    drain(r);
+  V(&mutex);
+}
+
+static void *drainer(void *vargp)
+{
+  log_ring *r;
+  int busy;
+
+  Pthread_detach(pthread_self());
+  while (1) {
+    busy = 0;
+    P(&mutex);
+    for (r = rings; r != NULL; r = r->next)
+      busy |= drain(r);
+    V(&mutex);
+    if (!busy)
+      usleep(LOG_IDLE_US);
+  }
+  return NULL;
+}
+
+/* log_init - Log to fd from now on, at log_level or more severe. */
+void log_init(int fd)
+{
+  pthread_t tid;
+
+  Sem_init(&mutex, 0, 1);
+  log_fd = fd;
+  if (log_level > LOG_MAX_LEVEL)
+    log_level = LOG_MAX_LEVEL;
+  Pthread_create(&tid, NULL, drainer, NULL);
+  atexit(log_flush);
+}
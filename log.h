@@ -0,0 +1,36 @@
+#pragma once
+
+#include "csapp.h"
+
+/* Asynchronous logger: per-thread rings drained by one thread */
+#define LOG_ERROR 0
+#define LOG_WARN  1
+#define LOG_INFO  2
+#define LOG_DEBUG 3
+
+/* Levels above this are compiled out; make DEBUG=1 keeps them all */
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_INFO
+#endif
+
+#define LOG_RING    (64 * 1024)   // bytes per thread
+#define LOG_MAX_MSG 4096          // longer messages are cut
+
+extern int log_level;       // runtime threshold, at most LOG_MAX_LEVEL
+
+#define LOG(lvl, ...)                                                    \
+  do {                                                                   \
+    if ((lvl) <= LOG_MAX_LEVEL && (lvl) <= log_level)                    \
+      log_write(lvl, __VA_ARGS__);                                       \
+  } while (0)
+
+#define log_error(...) LOG(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...)  LOG(LOG_WARN, __VA_ARGS__)
+#define log_info(...)  LOG(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) LOG(LOG_DEBUG, __VA_ARGS__)
+
+void log_init(int fd);
+int log_parse_level(const char *name);
+void log_write(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void log_flush(void);
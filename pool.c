@@ -0,0 +1,195 @@
+/*
+ * pool.c - idle origin connections for reuse by later requests
+ *
+ * Each origin (host:port) keeps up to POOL_MAX_IDLE idle sockets, newest
+ * last. pool_get hands out the newest one that still looks alive, since
+ * it is the least likely to have been closed by the origin. Sockets idle
+ * for longer than POOL_IDLE_TIMEOUT are closed whenever their origin is
+ * touched, and at most once a second every origin is swept for them and
+ * origins left with none are freed, so origins never visited again don't
+ * hold sockets. Past POOL_MAX_TOTAL idle sockets in all, the oldest one
+ * anywhere goes, which keeps the proxy's descriptors bounded however many
+ * origins it talks to.
+ */
+#include "pool.h"
+#include "stats.h"
+
+typedef struct origin
+{
+  char *key;
+  int idle[POOL_MAX_IDLE];
+  time_t since[POOL_MAX_IDLE];
+  int nidle;
+  struct origin *next;
+} origin_t;
+
+static origin_t *buckets[POOL_BUCKETS];
+static int total_idle;      // all origins
+static time_t last_sweep;
+static sem_t mutex;
+
+static unsigned int pool_hash(const char *s)
+{
+  unsigned int h = 5381;
+
+  while (*s)
+    h = h * 33 + (unsigned char)*s++;
+  return h;
+}
+
+/* Find the origin for host:port, adding it if create is set. Lock held. */
+static origin_t *pool_origin(const char *host, const char *port, int create)
+{
+  char key[MAXLINE];
+  origin_t *o;
+  unsigned int b;
+
+  snprintf(key, sizeof(key), "%s:%s", host, port);
+  b = pool_hash(key) % POOL_BUCKETS;
+  for (o = buckets[b]; o; o = o->next)
+    if (!strcmp(o->key, key))
+      return o;
+  if (!create)
+    return NULL;
+
+  o = Calloc(1, sizeof(origin_t));
+  o->key = strdup(key);
+  o->next = buckets[b];
+  buckets[b] = o;
+  return o;
+}
+
+/* Close the n oldest idle sockets of o. Lock held. */
+static void pool_drop(origin_t *o, int n)
+{
+  int i;
+
+  if (n == 0)
+    return;
+  for (i = 0; i < n; i++)
+    close(o->idle[i]);
+  for (i = n; i < o->nidle; i++) {
+    o->idle[i - n] = o->idle[i];
+    o->since[i - n] = o->since[i];
+  }
+  o->nidle -= n;
+  total_idle -= n;
+}
+
+/* Close idle sockets past POOL_IDLE_TIMEOUT. They are the oldest. Lock held. */
+static void pool_expire(origin_t *o, time_t now)
+{
+  int n = 0;
+
+  while (n < o->nidle && now - o->since[n] > POOL_IDLE_TIMEOUT)
+    n++;
+  pool_drop(o, n);
+}
+
+/* Expire every origin and free the ones left empty, once a second. Lock held. */
+static void pool_sweep(time_t now)
+{
+  origin_t **op, *o;
+  int b;
+
+  if (now == last_sweep)
+    return;
+  last_sweep = now;
+  for (b = 0; b < POOL_BUCKETS; b++) {
+    for (op = &buckets[b]; (o = *op) != NULL; ) {
+      pool_expire(o, now);
+      if (o->nidle > 0) {
+        op = &o->next;
+        continue;
+      }
+      *op = o->next;
+      Free(o->key);
+      Free(o);
+    }
+  }
+}
+
+/* Close the oldest idle socket of any origin. Lock held. */
+static void pool_drop_oldest(void)
+{
+  origin_t *o, *oldest = NULL;
+  int b;
+
+  for (b = 0; b < POOL_BUCKETS; b++)
+    for (o = buckets[b]; o; o = o->next)
+      if (o->nidle > 0 && (oldest == NULL || o->since[0] < oldest->since[0]))
+        oldest = o;
+  if (oldest)
+    pool_drop(oldest, 1);
+}
+
+/*
+ * pool_alive - An idle HTTP connection has nothing to read. EOF means the
+ *     origin closed it; stray bytes mean it is out of sync.
+ */
+static int pool_alive(int fd)
+{
+  char c;
+  ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+  return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+void pool_init(void)
+{
+  Sem_init(&mutex, 0, 1);
+}
+
+/*
+ * pool_get - Check out an idle connection to host:port. Returns -1 when
+ *     there is none, and the caller connects on its own.
+ */
+int pool_get(const char *host, const char *port)
+{
+  origin_t *o;
+  int fd;
+
+  while (1) {
+    P(&mutex);
+    pool_sweep(time(NULL));
+    if ((o = pool_origin(host, port, 0)) != NULL)
+      pool_expire(o, time(NULL));
+    if (o == NULL || o->nidle == 0) {
+      V(&mutex);
+      return -1;
+    }
+    fd = o->idle[--o->nidle];
+    total_idle--;
+    V(&mutex);
+
+    if (pool_alive(fd)) {
+      stats_add(STAT_POOL_REUSED, 1);
+      return fd;
+    }
+    close(fd);
+  }
+}
+
+/*
+ * pool_put - Check in a connection whose last response was read in full.
+ *     When the origin already has POOL_MAX_IDLE, its oldest one goes; when
+ *     the pool holds POOL_MAX_TOTAL, the oldest one of any origin does.
+ */
+void pool_put(const char *host, const char *port, int fd)
+{
+  origin_t *o;
+  time_t now = time(NULL);
+
+  P(&mutex);
+  pool_sweep(now);
+  o = pool_origin(host, port, 1);
+  pool_expire(o, now);
+  if (o->nidle == POOL_MAX_IDLE)
+    pool_drop(o, 1);
+  else if (total_idle == POOL_MAX_TOTAL)
+    pool_drop_oldest();
+  o->idle[o->nidle] = fd;
+  o->since[o->nidle++] = now;
+  total_idle++;
+  V(&mutex);
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "csapp.h"
+
+/* Persistent origin connections, keyed by host:port */
+#define POOL_BUCKETS      64
+#define POOL_MAX_IDLE     8     // idle connections kept per origin
+#define POOL_MAX_TOTAL    64    // idle connections kept in all
+#define POOL_IDLE_TIMEOUT 30    // seconds before an idle connection is dropped
+
+void pool_init(void);
+int pool_get(const char *host, const char *port);
+void pool_put(const char *host, const char *port, int fd);
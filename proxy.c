@@ -1,191 +1,119 @@
 #include <stdio.h>
+#include <netinet/tcp.h>
 #include "csapp.h"
+#include "proxy.h"
 #include "sbuf.h"
-#include "hash.h"
-
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000  // 1MB
-#define MAX_OBJECT_SIZE 102400  // 100KB
-#define MAX_CACHENODE_SIZE  10
+#include "cache.h"
+#include "event.h"
+#include "relay.h"
+#include "pool.h"
+#include "dns.h"
+#include "arena.h"
+#include "log.h"
+#include "stats.h"
 
 #define MAX_THREADS 4
 #define SBUFSIZE    16
+#define ARENA_BLOCK (256 * 1024)  // heads, buffers and a cacheable object
 
 /* You won't lose style points for including this long line in your code */
-static const char *user_agent_hdr =
+const char *user_agent_hdr =
     "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 
-int parse_uri(char *uri, char *filename, char *host, char *port);
-void read_response(rio_t *rp, char *content_length, char *res_header);
-void do_proxy(int fd);
-void read_requesthdrs(int fd, rio_t *rp, char *header, char *host);
+void do_proxy(int fd, arena_t *a);
+int do_request(int fd, rio_t *rp, arena_t *a);
+int relay_body(rio_t *rp, int fd, char *head, size_t head_len, char *buf,
+               cache_obj_t *obj, ssize_t len, int chunked);
 void serve_static(int fd, char *filename, int filesize, char *method);
 void get_filetype(char *filename, char *filetype);
 void clienterror(int fd, char *cause, char *errnum, char *shortmsg,
                  char *longmsg);
 
-/* cache */
-void init_cache();
-void deinit_cache();
-int search_cache(char *uri);
-void cache_insert(char *url, void *data, size_t data_size);
-void cache_remove();
-
 /* threads */
-sbuf_t sbuf, sbuf_cache;
+sbuf_t sbuf;
 
 void *thread(void *vargp)
 {
+  arena_t arena;    // the worker's request scratch
+  long waited;
+
   Pthread_detach(pthread_self());
+  arena_init(&arena, ARENA_BLOCK);
   while (1)
   {
-    int connfd = sbuf_remove(&sbuf);
-    do_proxy(connfd);
+    int connfd = sbuf_remove(&sbuf, &waited);
+    stats_add(STAT_DEQUEUED, 1);
+    stats_time(PH_QUEUE, waited);
+    do_proxy(connfd, &arena);
     Close(connfd);
+    stats_add(STAT_CLOSED, 1);
   }
 }
 
-/* cache */
-typedef struct cache_t
-{
-  int size;
-  int refer_cnt;
-  char *url;
-  void *data;
-} cache_node;
-
-typedef struct proxy_cache
-{
-  unsigned int total_size;
-  cache_node *cache[MAX_CACHENODE_SIZE];
-} proxy_cache_t;
-
-proxy_cache_t pcache;
-
-void init_cache()
-{
-  pcache.total_size = 0;
-  for (size_t i = 0; i < MAX_CACHENODE_SIZE; i++)
-  {
-    pcache.cache[i] = NULL;
-  }
-}
-
-void deinit_cache()
-{
-  for (size_t i = 0; i < MAX_CACHENODE_SIZE; i++)
-  {
-    if (pcache.cache[i] == NULL) continue;
-    Free(pcache.cache[i]->data);
-    Free(pcache.cache[i]->url);
-  }
-  // Free(pcache.cache);
-}
+int main(int argc, char **argv) {
+  int listenfd, connfd, i, opt, threaded = 0, numeric = 0;
+  char hostname[MAXLINE], port[MAXLINE];
+  socklen_t clientlen;
+  struct sockaddr_storage clientaddr;
+  pthread_t tid;
+  int one = 1;
 
-// return hit(1) or miss(0)
-int search_cache(char *uri)
-{
-  for (size_t i = 0; i < MAX_CACHENODE_SIZE; i++)
-  {
-    if (pcache.cache[i] == NULL) continue;
-    else if (strstr(pcache.cache[i]->url, uri)) {
-      pcache.cache[i]->refer_cnt++;
-      return i;
+  /* Check command line args */
+  while ((opt = getopt(argc, argv, "tnl:")) != -1) {
+    switch (opt) {
+    case 't':   // blocking thread pool instead of the event loops
+      threaded = 1;
+      break;
+    case 'n':   // log client addresses without a reverse lookup
+      numeric = NI_NUMERICHOST | NI_NUMERICSERV;
+      break;
+    case 'l':   // log level: error, warn, info or debug
+      if ((log_level = log_parse_level(optarg)) < 0) {
+        fprintf(stderr, "%s: unknown log level %s\n", argv[0], optarg);
+        exit(1);
+      }
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-tn] [-l level] <port>\n", argv[0]);
+      exit(1);
     }
   }
-  return -1;
-}
-
-void cache_insert(char *url, void *data, size_t data_size)
-{
-  // remove while affordable.
-  while (data_size > MAX_CACHE_SIZE - pcache.total_size)
-    cache_remove();
-
-  char *temp = Malloc(strlen(url));
-  strcpy(temp, url);
-
-  for (size_t i = 0; i < MAX_CACHENODE_SIZE; i++)
-  {
-    if (pcache.cache[i] != NULL) continue;
-
-    pcache.cache[i] = Malloc(sizeof(cache_node));
-
-    P(&sbuf_cache.slots);
-    P(&sbuf_cache.mutex);
-
-    pcache.cache[i]->url = temp;
-    pcache.cache[i]->refer_cnt = 0;
-    pcache.cache[i]->size = data_size;
-    pcache.cache[i]->data = data;
-    pcache.total_size += data_size;
-    
-    V(&sbuf_cache.mutex);
-    V(&sbuf_cache.items);
-
-    break;
-  }
-}
-
-// POLICY : LRU
-void cache_remove()
-{
-  int min = __INT32_MAX__, idx = 0;
-
-  for (size_t i = 0; i < MAX_CACHENODE_SIZE; i++)
-  {
-    if (pcache.cache[i] == NULL) continue;
-    else if (pcache.cache[i]->refer_cnt < min) {
-      min = pcache.cache[i]->refer_cnt;
-      idx = i;
-    }
+  if (optind != argc - 1) {
+    fprintf(stderr, "usage: %s [-tn] [-l level] <port>\n", argv[0]);
+    exit(1);
   }
-  if (min == __INT32_MAX__) return;
-  
-  // delete cache
-  P(&sbuf_cache.items);
-  P(&sbuf_cache.mutex);
+  stats_init();    // first: blocks SIGUSR1 for every thread started after it
+  log_init(STDOUT_FILENO);
 
-  pcache.total_size -= pcache.cache[idx]->size;
-  Free(pcache.cache[idx]->data);
-  Free(pcache.cache[idx]->url);
-  Free(pcache.cache);
+  // a client hanging up must not kill the proxy
+  Signal(SIGPIPE, SIG_IGN);
+  pool_init();
+  dns_init();
 
-  V(&sbuf_cache.mutex);
-  V(&sbuf_cache.slots);
-}
+  /* cache */
+  init_cache();
 
-int main(int argc, char **argv) {
-  int listenfd, connfd, i;
-  char hostname[MAXLINE], port[MAXLINE];
-  socklen_t clientlen;
-  struct sockaddr_storage clientaddr;
+  listenfd = Open_listenfd(argv[optind]);
+  if (!threaded)
+    event_run(listenfd, EV_THREADS);
 
   /* threads */
-  pthread_t tid;
   sbuf_init(&sbuf, SBUFSIZE);
-  sbuf_init(&sbuf_cache, SBUFSIZE);
-
-  /* cache */
-  init_cache();
 
   for (i = 0; i < MAX_THREADS; i++)
     Pthread_create(&tid, NULL, thread, NULL);
 
-  /* Check command line args */
-  if (argc != 2) {
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
-    exit(1);
-  }
-
-  listenfd = Open_listenfd(argv[1]);
   while (1) {
     clientlen = sizeof(clientaddr);
     connfd = Accept(listenfd, (SA *)&clientaddr,
                     &clientlen);  // line:netp:tiny:accept
+    // responses are coalesced by hand; Nagle would only hold relayed pieces
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
     Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE,
-                0);
-    printf("Accepted connection from (%s, %s)\n", hostname, port);
+                numeric);
+    log_info("Accepted connection from (%s, %s)\n", hostname, port);
+    stats_add(STAT_ACCEPTED, 1);
+    stats_add(STAT_QUEUED, 1);
     sbuf_insert(&sbuf, connfd);
   }
   
@@ -193,197 +121,466 @@ int main(int argc, char **argv) {
   return 0;
 }
 
-void do_proxy(int fd)
+void do_proxy(int fd, arena_t *a)
 {
-  char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE], header[MAXLINE];
-  char filename[MAXLINE], host[MAXLINE], *port = NULL;
-  const char http_port[] = "80";
-  rio_t rio, rio_client;
+  rio_t rio;
+  int more;
+  struct timeval idle = {KEEPALIVE_TIMEOUT, 0};
 
+  // an idle client hands the worker back after KEEPALIVE_TIMEOUT
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
   Rio_readinitb(&rio, fd);
 
+  // requests are answered one at a time, so pipelined ones stay in order
+  do {
+    more = do_request(fd, &rio, a);
+    arena_reset(a);
+  } while (more);
+}
+
+/*
+ * do_request - Serve the next request buffered in rp. Returns 1 if the
+ *     client connection can carry another request. Scratch memory comes
+ *     from a, which the caller resets afterwards.
+ */
+int do_request(int fd, rio_t *rp, arena_t *a)
+{
+  char *buf = arena_alloc(a, MAXBUF), *key = arena_alloc(a, MAXLINE);
+  char *host = arena_alloc(a, MAXLINE), port[16];
+  http_msg *req = arena_alloc(a, sizeof(http_msg));
+  ssize_t len;
+  cache_node *cached;
+  int keep_alive, rc, is_get, head_only;
+
   // Request Header
-  Rio_readlineb(&rio, buf, MAXLINE);
-  printf("Request headers:\n");
-  printf("%s", buf);
-  sscanf(buf, "%s %s %s", method, uri, version);
+  http_init(req, 0);
+  if ((rc = http_read(rp, req)) <= 0) {
+    if (rc == HTTP_TOO_BIG)
+      clienterror(fd, "request", "431", "Request Header Fields Too Large",
+                  "The request head is too large");
+    else if (rc == HTTP_BAD)
+      clienterror(fd, "request", "400", "Bad Request", "Malformed request");
+    return 0;
+  }
+  log_debug("Request headers:\n%.*s", (int)req->head_len, rp->rio_bufptr);
+  stats_add(STAT_REQUESTS, 1);
+  stats_time(PH_PARSE, req->parse_ns);
+
+  // addressed to the proxy itself
+  if (http_is(req, req->uri, STATS_PATH)) {
+    http_consume(rp, req);
+    stats_serve(fd);
+    return 0;
+  }
 
-  if (!strcmp(version, "HTTP/1.1"))
-    strcpy(version, "HTTP/1.0");
+  // the views die with the head, so take what outlives it first
+  is_get = http_is(req, req->method, "GET");
+  head_only = http_is(req, req->method, "HEAD");
+  if ((len = proxy_request(req, buf, MAXBUF, host, port, key, &keep_alive)) < 0) {
+    http_consume(rp, req);
+    clienterror(fd, "request", "400", "Bad Request", "Malformed request");
+    return 0;
+  }
+  http_consume(rp, req);
+
+  // Cache hit: served from memory, the origin never hears of it
+  if (is_get && (cached = search_cache(key)) != NULL) {
+    char *conn = keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    struct iovec iov[3];
+
+    log_debug("cache hit! \n");
+    stats_add(STAT_HITS, 1);
+    // the object stays pinned, so eviction can't free it under us;
+    // head, our Connection line and body leave in one writev
+    iov[0].iov_base = cached->data;
+    iov[0].iov_len = cached->head_len;
+    iov[1].iov_base = conn;
+    iov[1].iov_len = strlen(conn);
+    iov[2].iov_base = (char *)cached->data + cached->head_len;
+    iov[2].iov_len = cached->size - cached->head_len;
+    if (rio_writev(fd, iov, 3) < 0)
+      keep_alive = 0;
+    else
+      stats_add(STAT_BYTES_CACHE, iov[2].iov_len);
+    cache_unpin(cached);
+    return keep_alive;
+  }
 
-  read_requesthdrs(fd, &rio, header, host);
+  if (is_get)
+    stats_add(STAT_MISSES, 1);
+
+  char *response_header = arena_alloc(a, MAXBUF);
+  http_msg *resp = arena_alloc(a, sizeof(http_msg));
+  rio_t *rio_client = arena_alloc(a, sizeof(rio_t));
+  proxy_resp_t r;
+  ssize_t head_len = -1;
+  int clientfd, reused, tries;
+  long t;
+
+  // Write Order to the Server, over a pooled connection when there is one
+  for (tries = 0; ; tries++) {
+    reused = tries == 0 && (clientfd = pool_get(host, port)) >= 0;
+    if (!reused) {
+      t = stats_now();
+      if ((clientfd = dns_open_clientfd(host, port)) < 0) {   // ERROR
+        // ERROR MSG
+        clienterror(fd, host, "404", "Not found", "Tiny couldn't find this file");
+        return keep_alive;
+      }
+      stats_time(PH_CONNECT, stats_now() - t);
+    }
 
-  // Port forwarding
-  {
-    char *p = index(host, ':');
-    if (p == NULL) {
-      port = http_port;
-    } else {
-      *p = '\0';
-      port = p + 1;
+    // Response Header
+    Rio_readinitb(rio_client, clientfd);
+    http_init(resp, 1);
+    rc = HTTP_AGAIN;
+    t = stats_now();
+    if (rio_writen(clientfd, buf, len) >= 0 &&
+        (rc = http_read(rio_client, resp)) > 0) {
+      stats_time(PH_TTFB, stats_now() - t);
+      log_debug("\nResponse headers:\n%.*s", rc, rio_client->rio_bufptr);
+      head_len = proxy_response(resp, head_only, response_header, MAXBUF, &r);
+      http_consume(rio_client, resp);
+      break;
     }
-  }
+    Close(clientfd);
 
-  int clientfd = open_clientfd(host, port);
-  if (clientfd < 0) {   // ERROR
-    // ERROR MSG
-    clienterror(fd, filename, "404", "Not found", "Tiny couldn't find this file");
-    return;
+    // an idle origin may hang up just as we reuse it; retry on a new one
+    if (!reused || rc < 0) {
+      clienterror(fd, key, "502", "Bad Gateway", "The origin sent no valid response");
+      return 0;
+    }
+  }
+  if (head_len < 0) {
+    Close(clientfd);
+    clienterror(fd, key, "502", "Bad Gateway", "The origin's head is too large");
+    return 0;
   }
 
-  // Connection Established
-  char str_conn[]  = "Connection: close\r\n";
-  char str_proxyconn[] = "Proxy-Connection: close\r\n";
-  char contents_length[MAXLINE];
-
-  // Method
-  parse_uri(uri, filename, host, port);
-  sprintf(buf, "%s %s %s\r\n", method, filename, version);
+  // no Content-length and not chunked: the body runs until the origin closes
+  if (r.body_len < 0 && !r.chunked)
+    keep_alive = r.origin_keep = 0;
+
+  /* Cache miss: only whole 200 answers to GET are worth keeping */
+  char *relay = arena_alloc(a, MAXBUF);  // before obj, so obj can grow in place
+  cache_obj_t obj = {NULL};
+  if (is_get && r.status == 200 && !r.chunked)
+    cache_obj_start(&obj, a, response_header, head_len, r.body_len);
+
+  strcpy(response_header + head_len, keep_alive ? "Connection: keep-alive\r\n\r\n"
+                                                : "Connection: close\r\n\r\n");
+  t = stats_now();
+  if ((rc = relay_body(rio_client, fd, response_header, strlen(response_header),
+                       relay, &obj, r.body_len, r.chunked)) < 0) {
+    keep_alive = 0;     // the client didn't get the whole body
+    cache_obj_drop(&obj);
+  }
+  else {
+    stats_time(PH_BODY, stats_now() - t);
+    if (obj.buf != NULL) {
+      t = stats_now();
+      cache_obj_finish(&obj, key);
+      stats_time(PH_INSERT, stats_now() - t);
+    }
+  }
 
-  // Headers
-  strcat(buf, user_agent_hdr);
-  strcat(buf, header);
-  strcat(buf, str_conn);
-  strcat(buf, str_proxyconn);
-  strcat(buf, "\r\n");
-
-  // Write Order to the Server
-  Rio_writen(clientfd, buf, strlen(buf));
-  
-  // Get Response from server
-  char response_header[MAXLINE];
-  Rio_readinitb(&rio_client, clientfd);
-  
-  // Response Header
-  printf("\nResponse headers:\n");
-  read_response(&rio_client, contents_length, response_header);
+  // back to the pool only if the origin is ready for its next request
+  if (rc == 0 && r.origin_keep && rio_client->rio_cnt == 0)
+    pool_put(host, port, clientfd);
+  else
+    Close(clientfd);
+  return keep_alive;
+}
 
-  size_t i_contents_length = (size_t)atol(contents_length);
+/* Send all of p, telling TCP more follows so it can share a segment. */
+static int send_more(int fd, char *p, size_t n)
+{
+  ssize_t m;
 
-// DEBUG - traversal cache
-printf("===== in cache ====\n");
-  for (size_t i = 0; i < MAX_CACHENODE_SIZE; i++)
-  {
-    if (pcache.cache[i] == NULL) break;
-    else {
-      printf("index: %ld\n", i);
-      printf("data address: %p\n", pcache.cache[i]->data);
-      printf("url address: %p\n", pcache.cache[i]->url);
-      printf("url data: %s\n", pcache.cache[i]->url);
-      printf("data size: %d\n", pcache.cache[i]->size);
-      printf("refer cnt: %d\n", pcache.cache[i]->refer_cnt);
+  while (n > 0) {
+    if ((m = send(fd, p, n, MSG_MORE)) < 0) {
+      if (errno == EINTR) continue;
+      return -1;
     }
+    p += m;
+    n -= m;
   }
-printf("===== end cache ====\n");
-
-  // Cache hit
-  int cachedNum;
-  printf("searching filename: %s \n", filename);
-  if ((cachedNum = search_cache(filename)) >= 0) {
-    // serve static
-    printf("cache hit! \n");
-    Rio_writen(fd, response_header, strlen(response_header));
-    Rio_writen(fd, pcache.cache[cachedNum]->data, i_contents_length);
-    return;
-  }
-
-  /* Cache miss */
+  return 0;
+}
 
-  // Get Response Body from server
-  void *srcp = Malloc(i_contents_length);
-  Rio_readnb(&rio_client, srcp, i_contents_length);
+/*
+ * relay_body - Send the response head, then stream the body from the
+ *     origin to the client as it arrives, through buf (MAXBUF bytes).
+ *     len < 0 means read to EOF. The head goes out with the first body
+ *     bytes in one writev, or ahead of a splice with MSG_MORE, so a small
+ *     response is one segment. The bytes are also collected into obj
+ *     while it is still cacheable; once it isn't, whatever the origin
+ *     still has to send is spliced straight across. A chunked body is
+ *     passed on as is; the scanner only finds its end. Returns 0 when the
+ *     whole body went out, 1 if the origin sent junk after it and -1 if it
+ *     was cut short.
+ */
+int relay_body(rio_t *rp, int fd, char *head, size_t head_len, char *buf,
+               cache_obj_t *obj, ssize_t len, int chunked)
+{
+  struct iovec iov[2];
+  size_t want;
+  ssize_t n = 0, got, left = len;
+  int can_splice = !chunked;
+  int done = !chunked && len == 0, junk = 0;
+  chunk_t ck;
+
+  chunk_init(&ck);
+
+  while (!done) {
+    // user space doesn't need the rest, let the kernel move it
+    if (obj->buf == NULL && can_splice && rp->rio_cnt == 0) {
+      if (head_len > 0 && send_more(fd, head, head_len) < 0)
+        return -1;
+      head_len = 0;
+      if ((n = relay_splice(rp->rio_fd, fd, left)) != RELAY_NOSPLICE) {
+        if (n > 0)
+          stats_add(STAT_BYTES_ORIGIN, n);
+        if (n < 0 || (len >= 0 && n != left))
+          return -1;
+        return 0;
+      }
+      can_splice = 0;
+    }
 
-  // Caching / Policy: LRU / consider MAX_OBJECT_SIZE, MAX_CACHE_SIZE
-  if (i_contents_length <= MAX_OBJECT_SIZE) {
-    cache_insert(uri, srcp, i_contents_length);
+    want = (len < 0 || left > MAXBUF) ? MAXBUF : left;
+    if ((got = rio_readb(rp, buf, want)) <= 0) {
+      done = got == 0 && len < 0 && !chunked;
+      break;
+    }
+    n = got;
+    if (chunked) {
+      n = chunk_scan(&ck, buf, got);
+      junk = n < got;
+      done = ck.done;
+    }
+    else if (len >= 0)
+      done = (left -= n) == 0;
+
+    cache_obj_add(obj, buf, n);
+    iov[0].iov_base = head;
+    iov[0].iov_len = head_len;
+    iov[1].iov_base = buf;
+    iov[1].iov_len = n;
+    head_len = 0;
+    if (rio_writev(fd, iov, 2) < 0) {        // client went away
+      done = 0;
+      break;
+    }
+    stats_add(STAT_BYTES_ORIGIN, n);
   }
 
-  Rio_writen(fd, response_header, strlen(response_header));
-  Rio_writen(fd, srcp, i_contents_length);
-  // Free(srcp);
+  // no body, or the origin gave up before sending any
+  if (head_len > 0 && rio_writen(fd, head, head_len) < 0)
+    return -1;
+  return done ? junk : -1;
 }
 
 void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg)
 {
   char buf[MAXLINE], body[MAXLINE];
+  struct iovec iov[2];
 
+  stats_add(errnum[0] == '5' ? STAT_ERR_5XX : STAT_ERR_4XX, 1);
   sprintf(body, "<html><title>Tiny Error</title>");
   sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
   sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
   sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
   sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
 
-  sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-  Rio_writen(fd, buf, strlen(buf));
-  sprintf(buf, "Content-type: text/html\r\n");
-  Rio_writen(fd, buf, strlen(buf));
-  sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-  Rio_writen(fd, buf, strlen(buf));
-  Rio_writen(fd, body, strlen(body));
+  snprintf(buf, sizeof(buf), "HTTP/1.0 %s %s\r\n"
+           "Content-type: text/html\r\n"
+           "Content-length: %d\r\n\r\n", errnum, shortmsg, (int)strlen(body));
+  iov[0].iov_base = buf;
+  iov[0].iov_len = strlen(buf);
+  iov[1].iov_base = body;
+  iov[1].iov_len = strlen(body);
+  rio_writev(fd, iov, 2);   // the client may be gone; nothing to do then
 }
 
-void read_response(rio_t *rp, char *content_length, char *res_header)
+static int put(char *out, size_t size, size_t *n, const char *s, size_t len)
 {
-  char buf[MAXLINE];
-  char *p;
-  buf[0] = '\0';
-  *res_header = '\0';
-
-  do {
-    Rio_readlineb(rp, buf, MAXLINE);
-    buf[MAXLINE - 1] = '\0';
-    strcat(res_header, buf);
-    printf("%s", buf);
-    if ((p = strstr(buf, "Content-length:")) != NULL) {
-      strcpy(content_length, p + 16);
-    }
-  } while (strcmp(buf, "\r\n"));
+  if (*n + len >= size)
+    return -1;
+  memcpy(out + *n, s, len);
+  *n += len;
+  return 0;
+}
 
-  return;
+/* A header line as it came in, minus surrounding whitespace */
+static int put_hdr(char *out, size_t size, size_t *n, http_msg *m, http_hdr *h)
+{
+  return put(out, size, n, HTTP_P(m, h->name),
+             h->value.off + h->value.len - h->name.off) < 0 ||
+         put(out, size, n, "\r\n", 2) < 0 ? -1 : 0;
 }
 
-void read_requesthdrs(int fd, rio_t *rp, char *header, char *host)
+/*
+ * proxy_request - Rewrite the client's request head into the one for the
+ *     origin: path only, the client's HTTP version so an HTTP/1.0 client
+ *     never sees a chunked body, and our own User-Agent and Connection.
+ *     Fills host (MAXLINE) and port (16), and key (MAXLINE) with the
+ *     absolute URI http://host:port/path the cache knows the response by,
+ *     whichever form the request named it in. Decides whether the client
+ *     connection persists. Returns the length written to out, or -1 if the
+ *     request is unusable or doesn't fit.
+ */
+ssize_t proxy_request(http_msg *req, char *out, size_t size,
+                      char *host, char *port, char *key, int *keep_alive)
 {
-  char buf[MAXLINE];
+  const char *uri = HTTP_P(req, req->uri), *path = uri, *version;
+  size_t ulen = req->uri.len, plen = ulen, n = 0;
+  http_hdr *h;
   char *p;
+  int i, has_host = 0;
+
+  *host = '\0';
+  *keep_alive = http_is(req, req->version, "HTTP/1.1");
+  version = *keep_alive ? "HTTP/1.1" : "HTTP/1.0";
+
+  // absolute form names the origin itself
+  if (ulen > 7 && !strncasecmp(uri, "http://", 7)) {
+    size_t hlen;
+
+    path = memchr(uri + 7, '/', ulen - 7);
+    hlen = (path ? path : uri + ulen) - (uri + 7);
+    if (hlen >= MAXLINE)
+      return -1;
+    memcpy(host, uri + 7, hlen);
+    host[hlen] = '\0';
+    plen = path ? uri + ulen - path : 1;
+    if (path == NULL)
+      path = "/";
+  }
 
-  do {
-    Rio_readlineb(rp, buf, MAXLINE);
+  if (put(out, size, &n, HTTP_P(req, req->method), req->method.len) < 0 ||
+      put(out, size, &n, " ", 1) < 0 ||
+      put(out, size, &n, path, plen) < 0 ||
+      put(out, size, &n, " ", 1) < 0 ||
+      put(out, size, &n, version, 8) < 0 ||
+      put(out, size, &n, "\r\n", 2) < 0)
+    return -1;
 
-    if ((p = strstr(buf, "Host:")) != NULL) {
-      strcpy(host, p + 6);
-      char *temp = strchr(host, '\r');
-      *temp = '\0';
+  // Headers
+  for (i = 0; i < req->nhdrs; i++) {
+    h = &req->hdrs[i];
+    if (http_is(req, h->name, "Host")) {
+      has_host = 1;
+      if (*host == '\0' && http_copy(req, h->value, host, MAXLINE) < 0)
+        return -1;
+    }
+    else if (http_is(req, h->name, "Connection") ||
+             http_is(req, h->name, "Proxy-Connection")) {
+      // Connection and Proxy-Connection are ours to decide, not the origin's
+      if (http_has_token(req, h->value, "close"))
+        *keep_alive = 0;
+      else if (http_has_token(req, h->value, "keep-alive"))
+        *keep_alive = 1;
+      continue;
     }
-    if (strstr(buf, "Connection:"))
+    else if (http_is(req, h->name, "User-Agent") ||
+             http_is(req, h->name, "Keep-Alive"))
       continue;
-    // 아이디어 -> connection 지우고 버퍼 상에서 추가하기
+    // request bodies aren't forwarded, so don't read past one
+    else if (http_is(req, h->name, "Content-length") ||
+             http_is(req, h->name, "Transfer-Encoding"))
+      *keep_alive = 0;
 
-    if (strcmp(buf, "\r\n"))
-      strcat(header, buf);
+    if (put_hdr(out, size, &n, req, h) < 0)
+      return -1;
+  }
+
+  if (*host == '\0')
+    return -1;
+  if (!has_host &&
+      (put(out, size, &n, "Host: ", 6) < 0 ||
+       put(out, size, &n, host, strlen(host)) < 0 ||
+       put(out, size, &n, "\r\n", 2) < 0))
+    return -1;
+  if (put(out, size, &n, user_agent_hdr, strlen(user_agent_hdr)) < 0 ||
+      put(out, size, &n, "Connection: keep-alive\r\n\r\n", 26) < 0)
+    return -1;
 
-  } while (strcmp(buf, "\r\n"));
+  // Port forwarding
+  strcpy(port, "80");
+  if ((p = index(host, ':')) != NULL) {
+    *p = '\0';
+    if (strlen(p + 1) >= 16)
+      return -1;
+    strcpy(port, p + 1);
+  }
 
-  return;
+  // origins are told apart by host and port, not by the request-target alone
+  if (snprintf(key, MAXLINE, "http://%s:%s%.*s", host, port, (int)plen, path) >= MAXLINE)
+    return -1;
+  for (p = key + 7; *p != ':'; p++)
+    *p = tolower(*p);
+  out[n] = '\0';
+  return n;
 }
 
-int parse_uri(char *uri, char *filename, char *host, char *port)
+/*
+ * proxy_response - Copy the origin's response head to out minus its
+ *     hop-by-hop headers and the blank line ending it, so the engine can
+ *     add its own Connection header. Fills r with how the body is framed.
+ *     Returns the length written, or -1 if it doesn't fit.
+ */
+ssize_t proxy_response(http_msg *resp, int head_only, char *out, size_t size,
+                       proxy_resp_t *r)
 {
-  char *ptr;
-
-  // Host parse
-  if ((ptr = strstr(uri, host)) != NULL) {
-    ptr += strlen(host) + 1;
-    strcpy(filename, ptr);
+  char code[8];
+  size_t n = 0;
+  http_hdr *h;
+  int i;
+
+  r->status = resp->status;
+  r->body_len = -1;
+  r->chunked = 0;
+  r->origin_keep = http_is(resp, resp->version, "HTTP/1.1");
+
+  snprintf(code, sizeof(code), " %03d ", resp->status);
+  if (put(out, size, &n, HTTP_P(resp, resp->version), resp->version.len) < 0 ||
+      put(out, size, &n, code, 5) < 0 ||
+      put(out, size, &n, HTTP_P(resp, resp->reason), resp->reason.len) < 0 ||
+      put(out, size, &n, "\r\n", 2) < 0)
+    return -1;
+
+  for (i = 0; i < resp->nhdrs; i++) {
+    h = &resp->hdrs[i];
+    if (http_is(resp, h->name, "Connection")) {
+      if (http_has_token(resp, h->value, "close"))
+        r->origin_keep = 0;
+      else if (http_has_token(resp, h->value, "keep-alive"))
+        r->origin_keep = 1;
+      continue;
+    }
+    if (http_is(resp, h->name, "Proxy-Connection") ||
+        http_is(resp, h->name, "Keep-Alive"))
+      continue;
+    if (http_is(resp, h->name, "Content-length"))
+      r->body_len = strtol(HTTP_P(resp, h->value), NULL, 10);
+    else if (http_is(resp, h->name, "Transfer-Encoding") &&
+             http_has_token(resp, h->value, "chunked"))
+      r->chunked = 1;
+
+    if (put_hdr(out, size, &n, resp, h) < 0)
+      return -1;
   }
 
-  // Port parse
-  if ((ptr = strstr(ptr, port)) != NULL) {
-    ptr += strlen(port);
-    strcpy(filename, ptr);
+  // these never carry a body, whatever the headers say
+  if (head_only || r->status == 204 || r->status == 304 || r->status / 100 == 1) {
+    r->body_len = 0;
+    r->chunked = 0;
   }
-
-  return 0;
+  else if (r->chunked)
+    r->body_len = -1;
+  out[n] = '\0';
+  return n;
 }
 
 void serve_static(int fd, char *filename, int filesize, char *method)
@@ -398,8 +595,7 @@ void serve_static(int fd, char *filename, int filesize, char *method)
   sprintf(buf, "%sContent-length: %d\r\n", buf, filesize);
   sprintf(buf, "%sContent-type: %s\r\n\r\n", buf, filetype);
   Rio_writen(fd, buf, strlen(buf));
-  printf("Response headers:\n");
-  printf("%s", buf);
+  log_debug("Response headers:\n%s", buf);
 
   if (strcasecmp(method, "GET") == 0)
   {
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "http.h"
+
+/* Settings shared by the thread pool and the event loops */
+#define KEEPALIVE_TIMEOUT 5     // seconds an idle client connection is kept
+#define IO_TIMEOUT        60    // seconds a request may sit without progress
+
+extern const char *user_agent_hdr;
+
+/* How the origin frames its response, from proxy_response */
+typedef struct
+{
+  int status;
+  ssize_t body_len;         // -1: until the origin closes or the last chunk
+  int chunked;
+  int origin_keep;          // origin keeps the connection afterwards
+} proxy_resp_t;
+
+/* Head rewriting shared by both engines */
+ssize_t proxy_request(http_msg *req, char *out, size_t size,
+                      char *host, char *port, char *key, int *keep_alive);
+ssize_t proxy_response(http_msg *resp, int head_only, char *out, size_t size,
+                       proxy_resp_t *r);
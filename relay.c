@@ -0,0 +1,169 @@
+/*
+ * relay.c - zero-copy socket to socket forwarding
+ *
+ * Bytes go from one descriptor into a per-thread pipe and from the pipe
+ * to the other descriptor with splice(2), so they never enter user space.
+ * The event loops can't wait inside a relay, so they keep a pipe per
+ * connection and move bytes a step at a time with relay_splice_nb.
+ * Kept apart from csapp.h because splice needs _GNU_SOURCE, which clashes
+ * with csapp's gai_error().
+ *
+ * Also here: the chunked-encoding scanner that tells a relay where a
+ * Transfer-Encoding: chunked body ends, so the origin connection can be
+ * reused afterwards.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include "relay.h"
+
+static __thread int relay_pipe[2] = {-1, -1};
+
+static void relay_pipe_reset(void)
+{
+  if (relay_pipe[0] >= 0) {
+    close(relay_pipe[0]);
+    close(relay_pipe[1]);
+  }
+  relay_pipe[0] = relay_pipe[1] = -1;
+}
+
+/*
+ * relay_splice - Move len bytes (len < 0: until EOF) from one descriptor to
+ *     another. Returns the bytes moved, -1 on error, or RELAY_NOSPLICE when
+ *     the kernel can't splice these descriptors and nothing was moved yet.
+ */
+ssize_t relay_splice(int from, int to, ssize_t len)
+{
+  ssize_t total = 0, n, m;
+  size_t want;
+
+  if (relay_pipe[0] < 0 && pipe2(relay_pipe, O_CLOEXEC) < 0)
+    return RELAY_NOSPLICE;
+
+  while (len < 0 || total < len) {
+    want = (len < 0 || len - total > RELAY_CHUNK) ? RELAY_CHUNK : len - total;
+    n = splice(from, NULL, relay_pipe[1], NULL, want,
+               SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (total == 0 && (errno == EINVAL || errno == ENOSYS))
+        return RELAY_NOSPLICE;
+      return -1;
+    }
+    if (n == 0)             // EOF
+      break;
+
+    while (n > 0) {
+      // the last bytes of a known length go out without waiting for more
+      m = splice(relay_pipe[0], NULL, to, NULL, n,
+                 total + n == len ? SPLICE_F_MOVE : SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (m < 0) {
+        if (errno == EINTR) continue;
+        relay_pipe_reset(); // bytes stuck in the pipe belong to nobody
+        return -1;
+      }
+      n -= m;
+      total += m;
+    }
+  }
+  return total;
+}
+
+/* relay_pipe_open - A non-blocking pipe for relay_splice_nb. -1 on error. */
+int relay_pipe_open(int p[2])
+{
+  return pipe2(p, O_CLOEXEC | O_NONBLOCK);
+}
+
+/*
+ * relay_splice_nb - One splice of up to len bytes that never blocks; one
+ *     end must be a pipe. more tells TCP that further bytes follow.
+ *     Returns as splice(2): -1 with EAGAIN when nothing can move now, and
+ *     with EINVAL when the kernel can't splice these descriptors.
+ */
+ssize_t relay_splice_nb(int from, int to, size_t len, int more)
+{
+  unsigned int flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+
+  return splice(from, NULL, to, NULL, len, more ? flags | SPLICE_F_MORE : flags);
+}
+
+enum
+{
+  CK_SIZE,                  // hex chunk size
+  CK_EXT,                   // ;extensions up to CR
+  CK_SIZE_LF,
+  CK_DATA,
+  CK_DATA_CR,
+  CK_DATA_LF,
+  CK_TRAILER_START,         // start of a trailer line, or the final CRLF
+  CK_TRAILER,
+  CK_END_LF
+};
+
+void chunk_init(chunk_t *ck)
+{
+  ck->state = CK_SIZE;
+  ck->left = 0;
+  ck->done = 0;
+}
+
+/*
+ * chunk_scan - Feed the next n body bytes. Returns how many of them
+ *     belong to the body; fewer than n only once ck->done is set.
+ */
+size_t chunk_scan(chunk_t *ck, const char *buf, size_t n)
+{
+  size_t i = 0, skip;
+  char c;
+
+  while (i < n && !ck->done) {
+    if (ck->state == CK_DATA) {
+      skip = n - i < ck->left ? n - i : ck->left;
+      i += skip;
+      if ((ck->left -= skip) == 0)
+        ck->state = CK_DATA_CR;
+      continue;
+    }
+
+    c = buf[i++];
+    switch (ck->state) {
+    case CK_SIZE:
+      if (c >= '0' && c <= '9')
+        ck->left = ck->left * 16 + (c - '0');
+      else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+        ck->left = ck->left * 16 + ((c | 0x20) - 'a' + 10);
+      else if (c == ';' || c == ' ' || c == '\t')
+        ck->state = CK_EXT;
+      else if (c == '\r')
+        ck->state = CK_SIZE_LF;
+      break;
+    case CK_EXT:
+      if (c == '\r')
+        ck->state = CK_SIZE_LF;
+      break;
+    case CK_SIZE_LF:
+      ck->state = ck->left ? CK_DATA : CK_TRAILER_START;
+      break;
+    case CK_DATA_CR:
+      ck->state = CK_DATA_LF;
+      break;
+    case CK_DATA_LF:
+      ck->state = CK_SIZE;
+      break;
+    case CK_TRAILER_START:
+      ck->state = c == '\r' ? CK_END_LF : CK_TRAILER;
+      break;
+    case CK_TRAILER:
+      if (c == '\n')
+        ck->state = CK_TRAILER_START;
+      break;
+    case CK_END_LF:
+      ck->done = 1;
+      break;
+    }
+  }
+  return i;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <sys/types.h>
+
+#define RELAY_CHUNK     (1 << 16)   // bytes per splice, one pipe's worth
+#define RELAY_NOSPLICE  -2          // splice not supported for these fds
+
+ssize_t relay_splice(int from, int to, ssize_t len);
+int relay_pipe_open(int p[2]);
+ssize_t relay_splice_nb(int from, int to, size_t len, int more);
+
+/* Finds where a chunked body ends without decoding it */
+typedef struct
+{
+  int state;
+  size_t left;              // chunk data bytes still to skip
+  int done;                 // last chunk and trailers seen
+} chunk_t;
+
+void chunk_init(chunk_t *ck);
+size_t chunk_scan(chunk_t *ck, const char *buf, size_t n);
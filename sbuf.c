@@ -1,9 +1,11 @@
 #include "sbuf.h"
 #include "csapp.h"
+#include "stats.h"
 
 void sbuf_init(sbuf_t *sp, int n)
 {
     sp->buf = Calloc(n, sizeof(int));
+    sp->since = Calloc(n, sizeof(long));
     sp->n = n;
     sp->front = sp->rear = 0;
     Sem_init(&sp->mutex, 0, 1);
@@ -14,24 +16,32 @@ void sbuf_init(sbuf_t *sp, int n)
 void sbuf_deinit(sbuf_t *sp)
 {
     Free(sp->buf);
+    Free(sp->since);
 }
 
 void sbuf_insert(sbuf_t *sp, int item)
 {
+    long now = stats_now();     // before waiting for a slot, which counts too
     P(&sp->slots);
     P(&sp->mutex);
     sp->buf[(++sp->rear) % (sp->n)] = item;
+    sp->since[sp->rear % sp->n] = now;
     V(&sp->mutex);
     V(&sp->items);
 }
 
-int sbuf_remove(sbuf_t *sp)
+/* waited, if not NULL, gets the ns the item spent in the buffer */
+int sbuf_remove(sbuf_t *sp, long *waited)
 {
     int item;
+    long since;
     P(&sp->items);
     P(&sp->mutex);
     item = sp->buf[(++sp->front) % (sp->n)];
+    since = sp->since[sp->front % sp->n];
     V(&sp->mutex);
+    if (waited)
+        *waited = stats_now() - since;
     V(&sp->slots);
     return item;
 }
\ No newline at end of file
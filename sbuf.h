@@ -2,6 +2,7 @@
 
 typedef struct{
   int *buf;
+  long *since;    // when each item was inserted, in stats_now ns
   int n;
   int front;
   int rear;
@@ -13,4 +14,4 @@ typedef struct{
 void sbuf_init(sbuf_t *sp, int n);
 void sbuf_deinit(sbuf_t *sp);
 void sbuf_insert(sbuf_t *sp, int item);
-int sbuf_remove(sbuf_t *sp);
\ No newline at end of file
+int sbuf_remove(sbuf_t *sp, long *waited);
\ No newline at end of file
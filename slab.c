@@ -0,0 +1,262 @@
+/*
+ * slab.c - size classes for cache payloads
+ *
+ * Objects come from SLAB_PAGE pages carved out of a few large mmap'd
+ * regions. A page serves one size class at a time, its slots are all of
+ * the class size, and a freed slot goes back on its page's free list, so
+ * a cache churning through objects of mixed sizes reuses the same memory
+ * instead of fragmenting the heap. Classes are about 25% apart, which
+ * bounds the slack per object. A page whose last slot is freed loses its
+ * class and its physical memory (MADV_DONTNEED) and can then serve any
+ * class.
+ *
+ * Page descriptors live outside the pages, in the region header, so a
+ * class can be as large as a whole page. One lock covers everything;
+ * objects are allocated once per cached response and freed once.
+ *
+ * Built with -DSLAB_DISABLE, slab_alloc and slab_free are plain
+ * Malloc/Free, for comparison.
+ */
+#include <stdint.h>
+
+#include "slab.h"
+
+#define SLAB_PAGES_PER_REGION (SLAB_REGION / SLAB_PAGE)
+#define SLAB_MAX_CLASSES      64
+
+typedef struct slab_page
+{
+  int cls;                  // -1 while the page is free
+  int used, carved;         // live slots, slots ever handed out
+  void *free;               // freed slots, linked through their first word
+  char *base;
+  struct slab_page *prev, *next;  // class's partial pages, or free pages
+} slab_page;
+
+typedef struct
+{
+  char *base;               // SLAB_PAGE aligned
+  slab_page pages[SLAB_PAGES_PER_REGION];
+} slab_region;
+
+typedef struct
+{
+  size_t size;
+  int nslots;
+  slab_page *partial;       // pages with a free slot
+} slab_class;
+
+static slab_class classes[SLAB_MAX_CLASSES];
+static int nclasses;
+static slab_stats_t stats;
+static sem_t mutex;
+
+#ifndef SLAB_DISABLE
+static slab_region *regions[SLAB_MAX_REGIONS];
+static int nregions;
+static slab_page *free_pages;
+
+static void list_push(slab_page **head, slab_page *pg)
+{
+  pg->prev = NULL;
+  pg->next = *head;
+  if (*head)
+    (*head)->prev = pg;
+  *head = pg;
+}
+
+static void list_del(slab_page **head, slab_page *pg)
+{
+  if (pg->prev)
+    pg->prev->next = pg->next;
+  else
+    *head = pg->next;
+  if (pg->next)
+    pg->next->prev = pg->prev;
+}
+
+/* Lock held. Returns 0, or -1 when out of regions or memory. */
+static int region_add(void)
+{
+  slab_region *r;
+  char *p;
+  uintptr_t a;
+  int i;
+
+  if (nregions == SLAB_MAX_REGIONS)
+    return -1;
+  // one page extra, to align the region to SLAB_PAGE
+  p = mmap(NULL, SLAB_REGION + SLAB_PAGE, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED)
+    return -1;
+  a = ((uintptr_t)p + SLAB_PAGE - 1) & ~(uintptr_t)(SLAB_PAGE - 1);
+
+  r = Malloc(sizeof(slab_region));
+  r->base = (char *)a;
+  for (i = SLAB_PAGES_PER_REGION - 1; i >= 0; i--) {
+    r->pages[i].cls = -1;
+    r->pages[i].base = r->base + (size_t)i * SLAB_PAGE;
+    list_push(&free_pages, &r->pages[i]);
+  }
+  regions[nregions++] = r;
+  stats.mapped += SLAB_REGION;
+  return 0;
+}
+#endif
+
+void slab_init(void)
+{
+  size_t size = SLAB_MIN;
+
+  if (nclasses)             // already set up
+    return;
+  Sem_init(&mutex, 0, 1);
+  for (nclasses = 0; nclasses < SLAB_MAX_CLASSES; nclasses++) {
+    classes[nclasses].size = size;
+    classes[nclasses].nslots = SLAB_PAGE / size;
+    classes[nclasses].partial = NULL;
+    if (size == SLAB_PAGE) {
+      nclasses++;
+      break;
+    }
+    size = (size + size / 4 + 15) & ~(size_t)15;
+    if (size > SLAB_PAGE)
+      size = SLAB_PAGE;
+  }
+#ifndef SLAB_DISABLE
+  P(&mutex);
+  region_add();
+  V(&mutex);
+#endif
+}
+
+#ifdef SLAB_DISABLE
+size_t slab_size(size_t n)
+{
+  return n;
+}
+
+void *slab_alloc(size_t n)
+{
+  return Malloc(n);
+}
+
+void slab_free(void *p)
+{
+  Free(p);
+}
+#else
+static int class_of(size_t n)
+{
+  int lo = 0, hi = nclasses - 1;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+
+    if (classes[mid].size < n)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* slab_size - Bytes an n byte object really takes, for accounting. */
+size_t slab_size(size_t n)
+{
+  return n > SLAB_PAGE ? n : classes[class_of(n ? n : 1)].size;
+}
+
+/* Lock held. The page holding p. */
+static slab_page *page_of(void *p)
+{
+  int i;
+
+  for (i = 0; i < nregions; i++) {
+    slab_region *r = regions[i];
+
+    if ((char *)p >= r->base && (char *)p < r->base + SLAB_REGION)
+      return &r->pages[((char *)p - r->base) / SLAB_PAGE];
+  }
+  return NULL;
+}
+
+/* Objects over SLAB_PAGE, or any once the regions run out, use Malloc. */
+void *slab_alloc(size_t n)
+{
+  slab_class *c;
+  slab_page *pg;
+  void *p;
+
+  if (n == 0)
+    n = 1;
+  if (n > SLAB_PAGE)
+    return Malloc(n);
+  c = &classes[class_of(n)];
+
+  P(&mutex);
+  if ((pg = c->partial) == NULL) {
+    if (free_pages == NULL && region_add() < 0) {
+      V(&mutex);
+      return Malloc(n);
+    }
+    pg = free_pages;
+    list_del(&free_pages, pg);
+    pg->cls = c - classes;
+    pg->used = pg->carved = 0;
+    pg->free = NULL;
+    list_push(&c->partial, pg);
+    stats.pages_used++;
+  }
+
+  if ((p = pg->free) != NULL)
+    pg->free = *(void **)p;
+  else
+    p = pg->base + (size_t)pg->carved++ * c->size;
+  if (++pg->used == c->nslots)
+    list_del(&c->partial, pg);
+  stats.slot_bytes += c->size;
+  V(&mutex);
+  return p;
+}
+
+/* slab_free - Give p back to its page, or to Free if slab_alloc used it. */
+void slab_free(void *p)
+{
+  slab_class *c;
+  slab_page *pg;
+
+  if (p == NULL)
+    return;
+  P(&mutex);
+  if ((pg = page_of(p)) == NULL) {
+    V(&mutex);
+    Free(p);
+    return;
+  }
+  c = &classes[pg->cls];
+  if (pg->used-- == c->nslots)
+    list_push(&c->partial, pg);
+  *(void **)p = pg->free;
+  pg->free = p;
+  stats.slot_bytes -= c->size;
+
+  // an empty page goes back to the pool, without its memory
+  if (pg->used == 0) {
+    list_del(&c->partial, pg);
+    madvise(pg->base, SLAB_PAGE, MADV_DONTNEED);
+    pg->cls = -1;
+    list_push(&free_pages, pg);
+    stats.pages_used--;
+  }
+  V(&mutex);
+}
+#endif
+
+void slab_stats(slab_stats_t *s)
+{
+  P(&mutex);
+  *s = stats;
+  V(&mutex);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "csapp.h"
+
+/* Size-class allocator for cached objects */
+#define SLAB_PAGE        (128 * 1024)   // slots of one class; the largest class
+#define SLAB_REGION      (16 * SLAB_PAGE)
+#define SLAB_MAX_REGIONS 64
+#define SLAB_MIN         64             // smallest class
+
+typedef struct
+{
+  size_t mapped;            // bytes of regions reserved
+  size_t pages_used;        // pages given to a class
+  size_t slot_bytes;        // class sizes of all live allocations
+} slab_stats_t;
+
+void slab_init(void);
+void *slab_alloc(size_t n);
+void slab_free(void *p);
+size_t slab_size(size_t n);
+void slab_stats(slab_stats_t *s);
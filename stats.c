@@ -0,0 +1,222 @@
+/*
+ * stats.c - live proxy counters
+ *
+ * Every thread that counts gets its own block of counters, registered on
+ * its first stats_add. Only the owner writes a block, with a plain store,
+ * so counting costs a thread-local load and an add: no lock, no atomic
+ * read-modify-write and no cache line shared with another thread. Readers
+ * sum the blocks when asked, which is rare, and may see a count that is a
+ * request or two behind; gauges such as open connections are differences
+ * of two counters and can be briefly off by as much.
+ *
+ * Latencies are counted the same way, one histogram per phase in every
+ * block, and merged bucket by bucket when read. Percentiles report the
+ * top of the bucket they fall in, so they err high by at most 1/HIST_SUB.
+ *
+ * The report is served at STATS_PATH to a request that names no origin
+ * ("curl http://proxy:port/__proxy/stats") and written to the log on
+ * SIGUSR1.
+ */
+#include "stats.h"
+#include "cache.h"
+#include "arena.h"
+#include "slab.h"
+#include "log.h"
+
+__thread stats_block *stats_mine;
+static stats_block *blocks;     // all threads', pushed at registration, never removed
+
+/* Lock-free push, so a thread can count before stats_init or without it. */
+stats_block *stats_register(void)
+{
+  stats_block *s = Calloc(1, sizeof(stats_block));
+
+  s->next = __atomic_load_n(&blocks, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&blocks, &s->next, s, 1, __ATOMIC_RELEASE,
+                                      __ATOMIC_RELAXED))
+    ;
+  stats_mine = s;
+  return s;
+}
+
+/* stats_collect - Sum every thread's counters into v[STAT_N]. */
+void stats_collect(long *v)
+{
+  stats_block *s;
+  int i;
+
+  memset(v, 0, STAT_N * sizeof(long));
+  for (s = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); s != NULL; s = s->next)
+    for (i = 0; i < STAT_N; i++)
+      v[i] += __atomic_load_n(&s->v[i], __ATOMIC_RELAXED);
+}
+
+static const char *phase_names[PH_N] = {
+  "sbuf_wait", "parse", "connect", "ttfb", "body", "cache_insert"
+};
+
+/* Sum every thread's histograms into h. */
+static void hist_collect(long (*h)[HIST_BUCKETS])
+{
+  stats_block *s;
+  int p, i;
+
+  memset(h, 0, PH_N * sizeof(*h));
+  for (s = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); s != NULL; s = s->next)
+    for (p = 0; p < PH_N; p++)
+      for (i = 0; i < HIST_BUCKETS; i++)
+        h[p][i] += __atomic_load_n(&s->hist[p][i], __ATOMIC_RELAXED);
+}
+
+/* hist_top - The largest value bucket b holds */
+long hist_top(int b)
+{
+  int shift = b / HIST_SUB - 1;
+
+  if (b < HIST_SUB)
+    return b;
+  return ((long)(b % HIST_SUB + HIST_SUB + 1) << shift) - 1;
+}
+
+/* hist_quantile - The value at quantile q of h, which holds count samples */
+long hist_quantile(long *h, long count, double q)
+{
+  long want = (long)(q * count + 0.999999), seen = 0;
+  int b;
+
+  for (b = 0; b < HIST_BUCKETS; b++)
+    if ((seen += h[b]) >= want && seen > 0)
+      return hist_top(b);
+  return 0;
+}
+
+/* Per phase: count, then p50, p90, p99 and p999 in microseconds */
+static int hist_format(char *buf, size_t size)
+{
+  long (*h)[HIST_BUCKETS] = Malloc(PH_N * sizeof(*h)), count;
+  int p, b, n = 0, m;
+
+  hist_collect(h);
+  for (p = 0; p < PH_N && n < size; p++) {
+    for (count = 0, b = 0; b < HIST_BUCKETS; b++)
+      count += h[p][b];
+    m = snprintf(buf + n, size - n,
+                 "%s_count %ld\n"
+                 "%s_p50_us %.1f\n"
+                 "%s_p90_us %.1f\n"
+                 "%s_p99_us %.1f\n"
+                 "%s_p999_us %.1f\n",
+                 phase_names[p], count,
+                 phase_names[p], hist_quantile(h[p], count, 0.5) / 1e3,
+                 phase_names[p], hist_quantile(h[p], count, 0.9) / 1e3,
+                 phase_names[p], hist_quantile(h[p], count, 0.99) / 1e3,
+                 phase_names[p], hist_quantile(h[p], count, 0.999) / 1e3);
+    n += m;
+  }
+  Free(h);
+  return n < size ? n : size - 1;
+}
+
+/* stats_format - The report as "name value" lines; its length. */
+int stats_format(char *buf, size_t size)
+{
+  long v[STAT_N], lookups;
+  arena_stats_t as;
+  slab_stats_t ss;
+  int n;
+
+  stats_collect(v);
+  arena_stats(&as);
+  slab_stats(&ss);
+  lookups = v[STAT_HITS] + v[STAT_MISSES];
+
+  n = snprintf(buf, size,
+               "connections_active %ld\n"
+               "connections_accepted %ld\n"
+               "requests %ld\n"
+               "cache_hits %ld\n"
+               "cache_misses %ld\n"
+               "cache_hit_ratio %.3f\n"
+               "bytes_from_cache %ld\n"
+               "bytes_from_origin %ld\n"
+               "cache_bytes %zu\n"
+               "cache_inserts %ld\n"
+               "cache_evictions %ld\n"
+               "pool_reused %ld\n"
+               "sbuf_depth %ld\n"
+               "errors_4xx %ld\n"
+               "errors_5xx %ld\n"
+               "timeouts %ld\n"
+               "arena_requests %ld\n"
+               "arena_allocs %ld\n"
+               "arena_mallocs %ld\n"
+               "arena_bytes %zu\n"
+               "slab_mapped %zu\n"
+               "slab_pages_used %zu\n"
+               "slab_slot_bytes %zu\n",
+               v[STAT_ACCEPTED] - v[STAT_CLOSED], v[STAT_ACCEPTED],
+               v[STAT_REQUESTS], v[STAT_HITS], v[STAT_MISSES],
+               lookups ? (double)v[STAT_HITS] / lookups : 0.0,
+               v[STAT_BYTES_CACHE], v[STAT_BYTES_ORIGIN], cache_size(),
+               v[STAT_INSERTS], v[STAT_EVICTIONS], v[STAT_POOL_REUSED],
+               v[STAT_QUEUED] - v[STAT_DEQUEUED],
+               v[STAT_ERR_4XX], v[STAT_ERR_5XX], v[STAT_TIMEOUTS],
+               as.requests, as.allocs, as.mallocs, as.bytes,
+               ss.mapped, ss.pages_used, ss.slot_bytes);
+  if (n >= size)
+    return size - 1;
+  n += hist_format(buf + n, size - n);
+  return n;
+}
+
+/* stats_serve - Answer a STATS_PATH request on fd and close it after. */
+void stats_serve(int fd)
+{
+  char head[MAXLINE], body[MAXBUF];
+  struct iovec iov[2];
+  int n = stats_format(body, sizeof(body));
+
+  iov[0].iov_base = head;
+  iov[0].iov_len = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+                            "Content-type: text/plain\r\n"
+                            "Cache-Control: no-store\r\n"
+                            "Connection: close\r\n"
+                            "Content-length: %d\r\n\r\n", n);
+  iov[1].iov_base = body;
+  iov[1].iov_len = n;
+  rio_writev(fd, iov, 2);   // the client may be gone; nothing to do then
+}
+
+/* SIGUSR1 is taken here, where it is safe to lock and format. */
+static void *dumper(void *vargp)
+{
+  char buf[MAXBUF];
+  sigset_t set;
+  int sig;
+
+  Pthread_detach(pthread_self());
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  while (1) {
+    if (sigwait(&set, &sig) != 0)
+      continue;
+    stats_format(buf, sizeof(buf));
+    log_write(LOG_INFO, "stats:\n%s", buf);
+  }
+  return NULL;
+}
+
+/*
+ * stats_init - Block SIGUSR1 and start the thread that reports on it.
+ *     Call before any other thread starts, so they all inherit the mask.
+ */
+void stats_init(void)
+{
+  sigset_t set;
+  pthread_t tid;
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+  Pthread_create(&tid, NULL, dumper, NULL);
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "csapp.h"
+
+/* Proxy counters and latencies, per thread and summed only when read */
+#define STATS_PATH "/__proxy/stats"     // origin-form URI the proxy answers itself
+
+/*
+ * Latencies go into log-linear (HDR style) histograms of nanoseconds:
+ * every power of two is split into HIST_SUB buckets, so a bucket is
+ * within 1/HIST_SUB of any value in it.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 36            // longer clamps to 2^36 ns, about 69 s
+#define HIST_BUCKETS  ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+enum
+{
+  STAT_ACCEPTED,            // client connections
+  STAT_CLOSED,
+  STAT_REQUESTS,            // request heads parsed
+  STAT_HITS,                // GETs answered from the cache
+  STAT_MISSES,              // GETs sent to the origin
+  STAT_BYTES_CACHE,         // body bytes sent from the cache
+  STAT_BYTES_ORIGIN,        // body bytes relayed from origins
+  STAT_INSERTS,             // objects cached
+  STAT_EVICTIONS,
+  STAT_POOL_REUSED,         // origin connections taken from the pool
+  STAT_QUEUED,              // connections put in sbuf
+  STAT_DEQUEUED,            // connections taken from sbuf by a worker
+  STAT_ERR_4XX,             // error responses made by the proxy
+  STAT_ERR_5XX,
+  STAT_TIMEOUTS,            // connections closed by the event loops' sweep
+  STAT_N
+};
+
+/* Phases of a proxied request */
+enum
+{
+  PH_QUEUE,                 // accepted until a worker takes it from sbuf
+  PH_PARSE,                 // in the request head parser
+  PH_CONNECT,               // DNS and connect to the origin, if not pooled
+  PH_TTFB,                  // request sent until the response head is in
+  PH_BODY,                  // response head in until the body is sent
+  PH_INSERT,                // copying a finished response into the cache
+  PH_N
+};
+
+typedef struct stats_block
+{
+  long v[STAT_N];
+  long hist[PH_N][HIST_BUCKETS];
+  struct stats_block *next;
+  char pad[64];             // keep the next thread's block off our line
+} stats_block;
+
+extern __thread stats_block *stats_mine;
+stats_block *stats_register(void);
+
+/* Only the owning thread writes its block, so no atomic add is needed. */
+static inline void stats_add(int id, long n)
+{
+  stats_block *s = stats_mine;
+
+  if (s == NULL)
+    s = stats_register();
+  __atomic_store_n(&s->v[id], s->v[id] + n, __ATOMIC_RELAXED);
+}
+
+/* Monotonic clock in ns, the time base of every phase */
+static inline long stats_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static inline int hist_bucket(long ns)
+{
+  int shift;
+
+  if (ns < HIST_SUB)
+    return ns < 0 ? 0 : ns;
+  if (ns >= 1L << HIST_MAX_BITS)
+    ns = (1L << HIST_MAX_BITS) - 1;
+  shift = 63 - __builtin_clzl(ns) - HIST_SUB_BITS;
+  return (shift + 1) * HIST_SUB + (int)((ns >> shift) - HIST_SUB);
+}
+
+/* Record ns spent in phase */
+static inline void stats_time(int phase, long ns)
+{
+  stats_block *s = stats_mine;
+  long *b;
+
+  if (s == NULL)
+    s = stats_register();
+  b = &s->hist[phase][hist_bucket(ns)];
+  __atomic_store_n(b, *b + 1, __ATOMIC_RELAXED);
+}
+
+long hist_top(int b);
+long hist_quantile(long *h, long count, double q);
+
+void stats_init(void);
+void stats_collect(long *v);
+int stats_format(char *buf, size_t size);
+void stats_serve(int fd);
@@ -0,0 +1,75 @@
+#!/bin/bash
+#
+# cache_key.sh - two origins serving the same path must not share a
+#     cache entry
+#
+# Starts two tiny origins, each serving its own /who.txt, and asks a
+# proxy for /who.txt from each in origin form (path plus Host header),
+# twice, so the second round comes from the cache. Every answer must be
+# the one its own origin serves. Runs against both engines.
+#
+#     usage: test/cache_key.sh
+#
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+DIR=$(mktemp -d)
+PIDS=""
+FAILED=0
+
+function cleanup {
+    [ -n "${PIDS}" ] && kill ${PIDS} 2> /dev/null
+    rm -rf "${DIR}"
+}
+trap cleanup EXIT
+
+# wait_for_port - wait up to 5 seconds for a server to listen on port $1
+function wait_for_port {
+    for i in $(seq 50); do
+        (exec 3<> /dev/tcp/localhost/$1) 2> /dev/null && return 0
+        sleep 0.1
+    done
+    echo "cache_key.sh: nothing listening on port $1" >&2
+    exit 1
+}
+
+# get - body of /who.txt through the proxy on port $1, from origin port $2
+function get {
+    exec 3<> /dev/tcp/localhost/$1 || return
+    printf "GET /who.txt HTTP/1.0\r\nHost: localhost:%s\r\n\r\n" $2 >&3
+    sed '1,/^\r$/d' <&3
+    exec 3<&-
+}
+
+ORIGINS=""
+for who in first second; do
+    mkdir "${DIR}/${who}"
+    echo "${who}" > "${DIR}/${who}/who.txt"
+    port=$("${ROOT}/free-port.sh")
+    (cd "${DIR}/${who}" && exec "${ROOT}/tiny/tiny" ${port} > /dev/null) &
+    PIDS="${PIDS} $!"
+    wait_for_port ${port}
+    ORIGINS="${ORIGINS} ${who}:${port}"
+done
+
+for flags in "" "-t"; do
+    port=$("${ROOT}/free-port.sh")
+    "${ROOT}/proxy" ${flags} ${port} > /dev/null &
+    pid=$!
+    PIDS="${PIDS} ${pid}"
+    wait_for_port ${port}
+
+    for round in miss hit; do
+        for origin in ${ORIGINS}; do
+            want=${origin%:*}
+            got=$(get ${port} ${origin#*:})
+            if [ "${got}" != "${want}" ]; then
+                echo "FAIL proxy ${flags:-(event)} ${round}: origin ${want} answered \"${got}\""
+                FAILED=1
+            fi
+        done
+    done
+    kill ${pid}
+done
+
+[ ${FAILED} -eq 0 ] && echo "cache_key.sh: ok"
+exit ${FAILED}
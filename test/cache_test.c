@@ -0,0 +1,75 @@
+/*
+ * cache_test.c - eviction across shards must follow last use
+ *
+ * Caches one object alone in its shard, fills the rest of the budget from
+ * other shards, hits the lone object and then forces an eviction. The
+ * victim must be the oldest filler, not the object that was just hit.
+ *
+ * usage: test/cache_test
+ */
+#include "csapp.h"
+#include "cache.h"
+#include "hash.h"
+
+#define OBJ_SIZE 50000
+
+static unsigned int shard(char *url)
+{
+  return hasing((unsigned char *)url) % CACHE_SHARDS;
+}
+
+static void put(char *url)
+{
+  cache_insert(url, slab_alloc(OBJ_SIZE), 0, OBJ_SIZE);
+}
+
+/* Whether url is cached, without pinning it for longer than the look. */
+static int cached(char *url)
+{
+  cache_node *node = search_cache(url);
+
+  if (node == NULL)
+    return 0;
+  cache_unpin(node);
+  return 1;
+}
+
+int main(void)
+{
+  char lone[] = "http://lone:80/", url[64], first[64];
+  size_t charge;
+  int i = 0, failed = 0;
+
+  init_cache();
+  put(lone);
+  charge = cache_size();
+
+  // filler from every other shard, up to the last one that fits
+  *first = '\0';
+  while (cache_size() + charge <= MAX_CACHE_SIZE) {
+    snprintf(url, sizeof(url), "http://filler:80/%d", i++);
+    if (shard(url) == shard(lone))
+      continue;
+    if (*first == '\0')
+      strcpy(first, url);
+    put(url);
+  }
+
+  cached(lone);             // now the most recently used of all
+  do                        // one more evicts exactly one object
+    snprintf(url, sizeof(url), "http://filler:80/%d", i++);
+  while (shard(url) == shard(lone));
+  put(url);
+
+  if (!cached(lone)) {
+    printf("FAIL the object just hit was evicted\n");
+    failed = 1;
+  }
+  if (cached(first)) {
+    printf("FAIL the least recently used object was kept\n");
+    failed = 1;
+  }
+  if (!failed)
+    printf("cache_test: ok\n");
+  return failed;
+}
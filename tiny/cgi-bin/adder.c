@@ -1,44 +1,76 @@
 /*
  * adder.c - a minimal CGI program that adds two numbers together
+ *
+ * Run by tiny with -c cgi-bin/adder, it stays up and answers requests
+ * over the pool protocol in cgipool.h instead.
  */
 /* $begin adder */
 #include "csapp.h"
+#include "cgipool.h"
 
-int main(void) {
-  char *buf, *p, *method;
-  char arg1[MAXLINE], arg2[MAXLINE], content[MAXLINE];
-  int n1 = 0, n2 = 0;
-  
-  if ((buf = getenv("QUERY_STRING")) != NULL) {
-    p = strchr(buf, '&');
-    *p = '\0';
-    strcpy(arg1,   buf);
-    strcpy(arg2, p + 1);
-
-    char *a1 = strchr(arg1, '=');
-    char *a2 = strchr(arg2, '=');
-
-    n1 = atoi(a1 + 1);
-    n2 = atoi(a2 + 1);
-  }
+/* The CGI answer for one query into out; its length. */
+static int add(char *query, char *method, char *out, size_t size)
+{
+  char *p, *a1, *a2;
+  char content[MAXLINE];
+  int n1 = 0, n2 = 0, n;
 
-  method = getenv("REQUEST_METHOD");
+  // a=1&b=2
+  if (query != NULL && (p = strchr(query, '&')) != NULL) {
+    if ((a1 = strchr(query, '=')) != NULL && a1 < p)
+      n1 = atoi(a1 + 1);
+    if ((a2 = strchr(p + 1, '=')) != NULL)
+      n2 = atoi(a2 + 1);
+  }
 
-  sprintf(content, "QUERY_STRING=%s", buf);
   sprintf(content, "Welcome to add.com: ");
-  sprintf(content, "%sThe Internet addition portal.\r\n<p>", content);
-  sprintf(content, "%sThe answer is: %d + %d = %d\r\n<p>", content, n1, n2, n1 + n2);
-  sprintf(content, "%sThanks for visiting!\r\n", content);
+  sprintf(content + strlen(content), "The Internet addition portal.\r\n<p>");
+  sprintf(content + strlen(content), "The answer is: %d + %d = %d\r\n<p>",
+          n1, n2, n1 + n2);
+  sprintf(content + strlen(content), "Thanks for visiting!\r\n");
+
+  n = snprintf(out, size, "Connection: close\r\n"
+               "Content-length: %d\r\n"
+               "Content-type: text/html\r\n\r\n%s", (int)strlen(content),
+               method != NULL && strcasecmp(method, "GET") == 0 ? content : "");
+  return n < size ? n : size - 1;
+}
+
+/* Pooled: one framed request after another until tiny closes stdin */
+static void serve_pool(void)
+{
+  char *req, out[MAXBUF];
+  uint32_t len;
 
-  printf("Connection: close\r\n");
-  printf("Content-length: %d\r\n", (int)strlen(content));
-  printf("Content-type: text/html\r\n\r\n");
+  while (rio_readn(STDIN_FILENO, &len, sizeof(len)) == sizeof(len)) {
+    if (len > CGIPOOL_MAX_MSG)
+      exit(1);
+    req = Malloc(len + 1);
+    if (rio_readn(STDIN_FILENO, req, len) != len)
+      exit(1);
+    req[len] = '\0';
+    // QUERY_STRING\0REQUEST_METHOD\0
+    len = add(req, req + strlen(req) + 1 < req + len ? req + strlen(req) + 1 : NULL,
+              out, sizeof(out));
+    Free(req);
+    if (rio_writen(STDIN_FILENO, &len, sizeof(len)) < 0 ||
+        rio_writen(STDIN_FILENO, out, len) < 0)
+      exit(1);
+  }
+  exit(0);
+}
 
-  if (strcasecmp(method, "GET") == 0)
-    printf("%s", content);
+int main(void) {
+  char out[MAXBUF];
+  int n;
+
+  if (getenv(CGIPOOL_ENV) != NULL)
+    serve_pool();
 
+  n = add(getenv("QUERY_STRING"), getenv("REQUEST_METHOD"), out, sizeof(out));
+  fwrite(out, 1, n, stdout);
   fflush(stdout);
-  
+
   exit(0);
 }
 /* $end adder */
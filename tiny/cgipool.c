@@ -0,0 +1,169 @@
+/*
+ * cgipool.c - long-lived CGI worker processes
+ *
+ * A program named with tiny -c is started CGIPOOL_WORKERS times up
+ * front, each with one end of a socketpair as its stdin, and then
+ * serves requests over it as described in cgipool.h instead of being
+ * forked and exec'd per request. A request takes an idle worker, sends
+ * the query and method, reads the answer and hands the worker back.
+ *
+ * A worker that dies shows up as a failed write or an early EOF. It is
+ * killed for good measure, reaped and started again, and the request is
+ * retried once on the new process. Programs that aren't pooled, or a
+ * pool that can't get a working process, fall back to plain fork/exec.
+ */
+#include "cgipool.h"
+
+typedef struct
+{
+  pid_t pid;                // 0 while not running
+  int fd;                   // our end of its socketpair
+} cgi_worker;
+
+typedef struct
+{
+  char path[MAXLINE];       // as tiny builds it: "./cgi-bin/adder"
+  cgi_worker w[CGIPOOL_WORKERS];
+  int idle[CGIPOOL_WORKERS];
+  int nidle;
+  sem_t mutex;
+  sem_t avail;              // counts idle workers
+} cgi_prog;
+
+static cgi_prog progs[CGIPOOL_PROGS];
+static int nprogs;
+
+/* Start the program on a fresh socketpair. -1 if that fails. */
+static int spawn(cgi_prog *cp, cgi_worker *w)
+{
+  char *argv[] = {cp->path, NULL};
+  int sv[2];
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    return -1;
+  fcntl(sv[0], F_SETFD, FD_CLOEXEC);   // other workers mustn't inherit it
+  if ((w->pid = fork()) < 0) {
+    close(sv[0]);
+    close(sv[1]);
+    w->pid = 0;
+    return -1;
+  }
+  if (w->pid == 0) {
+    setenv(CGIPOOL_ENV, "1", 1);
+    Dup2(sv[1], STDIN_FILENO);
+    close(sv[1]);
+    execve(cp->path, argv, environ);
+    _exit(127);
+  }
+  close(sv[1]);
+  w->fd = sv[0];
+  return 0;
+}
+
+static void reap(cgi_worker *w)
+{
+  close(w->fd);
+  kill(w->pid, SIGKILL);
+  waitpid(w->pid, NULL, 0);
+  w->pid = 0;
+}
+
+/* cgipool_add - Pool the CGI program at path, relative to tiny's root. */
+void cgipool_add(char *path)
+{
+  cgi_prog *cp;
+  int i;
+
+  if (nprogs == CGIPOOL_PROGS)
+    app_error("too many pooled CGI programs");
+  cp = &progs[nprogs++];
+  // match the filenames parse_uri makes
+  snprintf(cp->path, sizeof(cp->path), "%s%s",
+           path[0] == '.' || path[0] == '/' ? "" : "./", path);
+  Sem_init(&cp->mutex, 0, 1);
+  Sem_init(&cp->avail, 0, CGIPOOL_WORKERS);
+  for (i = 0; i < CGIPOOL_WORKERS; i++) {
+    if (spawn(cp, &cp->w[i]) < 0)
+      fprintf(stderr, "cgipool: can't start %s: %s\n", cp->path, strerror(errno));
+    cp->idle[i] = i;
+  }
+  cp->nidle = CGIPOOL_WORKERS;
+}
+
+/* One request on w. The answer in a Malloc'd *out, or -1. */
+static ssize_t ask(cgi_worker *w, char *cgiargs, char *method, char **out)
+{
+  uint32_t len = strlen(cgiargs) + 1 + strlen(method) + 1;
+  struct iovec iov[3];
+  char *buf;
+
+  iov[0].iov_base = &len;
+  iov[0].iov_len = sizeof(len);
+  iov[1].iov_base = cgiargs;
+  iov[1].iov_len = strlen(cgiargs) + 1;
+  iov[2].iov_base = method;
+  iov[2].iov_len = strlen(method) + 1;
+  if (rio_writev(w->fd, iov, 3) < 0)
+    return -1;
+
+  if (rio_readn(w->fd, &len, sizeof(len)) != sizeof(len) || len > CGIPOOL_MAX_MSG)
+    return -1;
+  buf = Malloc(len);
+  if (rio_readn(w->fd, buf, len) != len) {
+    Free(buf);
+    return -1;
+  }
+  *out = buf;
+  return len;
+}
+
+/*
+ * cgipool_serve - Answer a request for the program at path from its
+ *     pool. Returns 0 once the client has its answer, -1 if path isn't
+ *     pooled or no worker could answer; the caller fork/execs then.
+ */
+int cgipool_serve(int fd, char *path, char *cgiargs, char *method)
+{
+  static const char head[] = "HTTP/1.0 200 OK\r\nServer: Tiny Web Server\r\n";
+  struct iovec iov[2];
+  cgi_prog *cp = NULL;
+  cgi_worker *w;
+  char *out = NULL;
+  ssize_t n = -1;
+  int i, slot, tries;
+
+  for (i = 0; i < nprogs; i++)
+    if (!strcmp(progs[i].path, path))
+      cp = &progs[i];
+  if (cp == NULL)
+    return -1;
+
+  P(&cp->avail);
+  P(&cp->mutex);
+  slot = cp->idle[--cp->nidle];
+  V(&cp->mutex);
+  w = &cp->w[slot];
+
+  // a dead worker gets replaced and the request tried again once
+  for (tries = 0; tries < 2 && n < 0; tries++) {
+    if (w->pid == 0 && spawn(cp, w) < 0)
+      break;
+    if ((n = ask(w, cgiargs, method, &out)) < 0)
+      reap(w);
+  }
+
+  P(&cp->mutex);
+  cp->idle[cp->nidle++] = slot;
+  V(&cp->mutex);
+  V(&cp->avail);
+
+  if (n < 0)
+    return -1;
+  iov[0].iov_base = (char *)head;
+  iov[0].iov_len = sizeof(head) - 1;
+  iov[1].iov_base = out;
+  iov[1].iov_len = n;
+  rio_writev(fd, iov, 2);   // the client may be gone; nothing to do then
+  Free(out);
+  return 0;
+}
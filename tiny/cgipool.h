@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+#include "csapp.h"
+
+/*
+ * Pooled CGI protocol. A program started with CGIPOOL_ENV set serves
+ * requests on its stdin, a socket, until it reads EOF. Each request is a
+ * uint32_t length followed by QUERY_STRING and REQUEST_METHOD, each NUL
+ * terminated; each answer a uint32_t length followed by what the program
+ * would have printed as a plain CGI program. Lengths are in host order.
+ */
+#define CGIPOOL_ENV      "TINY_CGI_POOL"
+#define CGIPOOL_MAX_MSG  (1 << 20)
+
+/* tiny's side */
+#define CGIPOOL_WORKERS  4      // processes per pooled program
+#define CGIPOOL_PROGS    8
+
+void cgipool_add(char *path);
+int cgipool_serve(int fd, char *path, char *cgiargs, char *method);
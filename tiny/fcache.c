@@ -0,0 +1,236 @@
+/*
+ * fcache.c - open-file cache for tiny's static path
+ *
+ * Entries are keyed by path and hold what serving the file takes: an
+ * open descriptor, its stat, the MIME type and the prebuilt response
+ * head, all but the Connection line, which depends on the request.
+ * Files up to FCACHE_SMALL are read once into memory, so a hit on one is
+ * a single writev and its descriptor is closed again.
+ *
+ * An entry is trusted for FCACHE_CHECK_MS. After that the next lookup
+ * stats the path again, and if the file is gone or its inode, size or
+ * mtime changed, the entry is dropped and the file loaded afresh. So an
+ * edit shows up within a second and a hot file costs one stat a second
+ * instead of stat, open and close per request.
+ *
+ * Readers pin what fcache_get returns and unpin it with fcache_put;
+ * dropping an entry only unlinks it, and its descriptor and memory go
+ * with the last reader. Files are loaded outside the lock.
+ */
+#include "fcache.h"
+
+static fc_entry *buckets[FCACHE_BUCKETS];
+static fc_entry *lru_head, *lru_tail;
+static int nentries;
+static size_t nbytes;       // data buffers of all linked entries
+static sem_t mutex;
+
+static long now_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static unsigned int hash_path(char *s)
+{
+  unsigned int h = 2166136261u;   // FNV-1a
+
+  while (*s)
+    h = (h ^ (unsigned char)*s++) * 16777619u;
+  return h % FCACHE_BUCKETS;
+}
+
+void get_filetype(char *filename, char *filetype)
+{
+  if (strstr(filename, ".html"))
+    strcpy(filetype, "text/html");
+  else if (strstr(filename, ".gif"))
+    strcpy(filetype, "image/gif");
+  else if (strstr(filename, ".png"))
+    strcpy(filetype, "image/png");
+  else if (strstr(filename, ".jpg"))
+    strcpy(filetype, "image/jpeg");
+  else if (strstr(filename, ".mp4"))
+    strcpy(filetype, "video/mp4");
+  else
+    strcpy(filetype, "text/plain");
+}
+
+void fcache_init(void)
+{
+  Sem_init(&mutex, 0, 1);
+}
+
+static void entry_free(fc_entry *e)
+{
+  if (e->fd >= 0)
+    close(e->fd);
+  Free(e->path);
+  Free(e->head);
+  if (e->data)
+    Free(e->data);
+  Free(e);
+}
+
+void fcache_put(fc_entry *e)
+{
+  if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    entry_free(e);
+}
+
+/* Lock held. Take e out of the table and drop the cache's reference. */
+static void unlink_entry(fc_entry *e)
+{
+  fc_entry **pp = &buckets[hash_path(e->path)];
+
+  while (*pp != e)
+    pp = &(*pp)->hnext;
+  *pp = e->hnext;
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    lru_head = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    lru_tail = e->prev;
+
+  nentries--;
+  if (e->data)
+    nbytes -= e->size;
+  fcache_put(e);
+}
+
+/* Lock held. Most recently used first. */
+static void lru_push(fc_entry *e)
+{
+  e->prev = NULL;
+  e->next = lru_head;
+  if (lru_head)
+    lru_head->prev = e;
+  else
+    lru_tail = e;
+  lru_head = e;
+}
+
+static int same_file(struct stat *a, struct stat *b)
+{
+  return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+         a->st_size == b->st_size &&
+         a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+         a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/*
+ * load - Open path and build its entry, or NULL with errno set: as open
+ *     left it, or EACCES for anything that isn't a readable regular file.
+ */
+static fc_entry *load(char *path)
+{
+  fc_entry *e;
+  struct stat st;
+  char head[MAXLINE];
+  int fd, n;
+
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+    return NULL;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || !(S_IRUSR & st.st_mode)) {
+    close(fd);
+    errno = EACCES;
+    return NULL;
+  }
+
+  e = Calloc(1, sizeof(fc_entry));
+  e->path = strdup(path);
+  e->fd = fd;
+  e->size = st.st_size;
+  e->st = st;
+  e->checked = now_ms();
+  get_filetype(path, e->filetype);
+  n = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\n"
+               "Server: Tiny Web Server\r\n"
+               "Content-length: %lld\r\n"
+               "Content-type: %s\r\n", (long long)e->size, e->filetype);
+  e->head = Malloc(n);
+  memcpy(e->head, head, n);
+  e->head_len = n;
+
+  // a small file lives in memory and needs no descriptor
+  if (e->size <= FCACHE_SMALL) {
+    e->data = Malloc(e->size ? e->size : 1);
+    if (rio_readn(fd, e->data, e->size) == e->size) {
+      close(fd);
+      e->fd = -1;
+    }
+    else {                  // shrank while we read it; use the descriptor
+      Free(e->data);
+      e->data = NULL;
+    }
+  }
+  return e;
+}
+
+/*
+ * fcache_get - The pinned entry for path, from the cache or freshly
+ *     loaded. NULL with errno set if the file can't be served.
+ */
+fc_entry *fcache_get(char *path)
+{
+  unsigned int b = hash_path(path);
+  fc_entry *e, *fresh;
+  struct stat st;
+  long now = now_ms();
+
+  P(&mutex);
+  for (e = buckets[b]; e != NULL; e = e->hnext)
+    if (!strcmp(e->path, path))
+      break;
+  if (e != NULL && now - e->checked >= FCACHE_CHECK_MS) {
+    // due for a check; a changed file is as good as a miss
+    if (stat(path, &st) == 0 && same_file(&st, &e->st))
+      e->checked = now;
+    else {
+      unlink_entry(e);
+      e = NULL;
+    }
+  }
+  if (e != NULL) {
+    if (e != lru_head) {
+      e->prev->next = e->next;
+      if (e->next)
+        e->next->prev = e->prev;
+      else
+        lru_tail = e->prev;
+      lru_push(e);
+    }
+    __atomic_add_fetch(&e->refs, 1, __ATOMIC_ACQ_REL);
+    V(&mutex);
+    return e;
+  }
+  V(&mutex);
+
+  if ((fresh = load(path)) == NULL)
+    return NULL;
+  fresh->refs = 2;          // the cache's and the caller's
+
+  P(&mutex);
+  // someone may have loaded it meanwhile; the newer copy wins
+  for (e = buckets[b]; e != NULL; e = e->hnext)
+    if (!strcmp(e->path, path)) {
+      unlink_entry(e);
+      break;
+    }
+  while (lru_tail != NULL && (nentries >= FCACHE_ENTRIES ||
+         (fresh->data && nbytes + fresh->size > FCACHE_BYTES)))
+    unlink_entry(lru_tail);
+  fresh->hnext = buckets[b];
+  buckets[b] = fresh;
+  lru_push(fresh);
+  nentries++;
+  if (fresh->data)
+    nbytes += fresh->size;
+  V(&mutex);
+  return fresh;
+}
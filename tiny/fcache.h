@@ -0,0 +1,31 @@
+#pragma once
+
+#include "csapp.h"
+
+/* Open-file cache for the static path */
+#define FCACHE_BUCKETS  256
+#define FCACHE_ENTRIES  128             // open descriptors kept at most
+#define FCACHE_SMALL    (64 * 1024)     // files kept in memory up to this
+#define FCACHE_BYTES    (16 * 1024 * 1024)  // memory for those files
+#define FCACHE_CHECK_MS 1000            // re-stat an entry at most this often
+
+typedef struct fc_entry
+{
+  char *path;
+  int fd;                   // open for reading, -1 once the file is in data
+  off_t size;
+  struct stat st;           // as of the last check
+  long checked;             // ms, monotonic
+  char filetype[32];
+  char *head;               // 200 response head up to the Connection line
+  size_t head_len;
+  char *data;               // the whole file, for small files
+  int refs;                 // the cache's own plus one per reader
+  struct fc_entry *hnext;   // bucket chain
+  struct fc_entry *prev, *next;  // LRU list
+} fc_entry;
+
+void fcache_init(void);
+fc_entry *fcache_get(char *path);
+void fcache_put(fc_entry *e);
+void get_filetype(char *filename, char *filetype);
@@ -1,92 +1,273 @@
 /* $begin tinymain */
 /*
- * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the
- *     GET method to serve static and dynamic content.
+ * tiny.c - A simple HTTP/1.0 Web server that uses the GET method to
+ *     serve static and dynamic content. Iterative by default; with
+ *     -t N a pool of N prethreaded workers serves connections queued by
+ *     the main thread. CGI programs named with -c run as long-lived
+ *     pooled processes instead of one fork/exec per request.
+ *
+ *     With workers, connections persist: a client that asks for it
+ *     (HTTP/1.1, or Connection: keep-alive) gets static answers and
+ *     errors framed by Content-length and may send, or pipeline, more
+ *     requests until it has been idle for KEEPALIVE_TIMEOUT. CGI output
+ *     still ends at close. Between requests a connection belongs to the
+ *     main thread, which waits on it with epoll and queues it for a worker
+ *     again once the next request arrives, so idle clients never hold a
+ *     worker. A single-threaded tiny closes after every request so that
+ *     an idle client can't hold it.
  *
  * Updated 11/2019 droh
  *   - Fixed sprintf() aliasing issue in serve_static(), and clienterror().
  */
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <poll.h>
 #include "csapp.h"
+#include "fcache.h"
+#include "sbuf.h"
+#include "cgipool.h"
+
+#define SENDFILE_CHUNK (1 << 20)  // bytes per sendfile call
+#define SBUFSIZE       64         // accepted connections waiting for a worker
+#define KEEPALIVE_TIMEOUT 5       // seconds an idle persistent connection lives
 
-void doit(int fd);
-void read_requesthdrs(rio_t *rp);
+void serve_workers(int listenfd);
+int serve_conn(int fd);
+int doit(int fd, rio_t *rp);
+int read_requesthdrs(rio_t *rp, int *keep_alive);
 int parse_uri(char *uri, char *filename, char *cgiargs);
-void serve_static(int fd, char *filename, int filesize, char *method);
-void get_filetype(char *filename, char *filetype);
+int serve_static(int fd, fc_entry *e, char *method, int keep_alive);
 void serve_dynamic(int fd, char *filename, char *cgiargs, char *method);
 void clienterror(int fd, char *cause, char *errnum, char *shortmsg,
                  char *longmsg);
 
+/* workers */
+sbuf_t sbuf;
+static int persist;         // connections may outlive a request
+static int idle_pipe[2];    // idle persistent connections, back to main
+
+void *thread(void *vargp)
+{
+  Pthread_detach(pthread_self());
+  while (1) {
+    int connfd = sbuf_remove(&sbuf);
+
+    if (serve_conn(connfd))
+      Rio_writen(idle_pipe[1], &connfd, sizeof(connfd));
+    else
+      Close(connfd);
+  }
+}
+
 int main(int argc, char **argv) {
-  int listenfd, connfd;
+  int listenfd, connfd, opt, i, nthreads = 0;
   char hostname[MAXLINE], port[MAXLINE];
   socklen_t clientlen;
   struct sockaddr_storage clientaddr;
+  pthread_t tid;
+
+  // a client hanging up, or a CGI worker dying, must not take the
+  // other clients down with it
+  Signal(SIGPIPE, SIG_IGN);
 
   /* Check command line args */
-  if (argc != 2) {
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
+  while ((opt = getopt(argc, argv, "t:c:")) != -1) {
+    switch (opt) {
+    case 't':   // prethreaded workers instead of serving one at a time
+      nthreads = atoi(optarg);
+      break;
+    case 'c':   // CGI program that speaks the pool protocol, e.g. cgi-bin/adder
+      cgipool_add(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-t threads] [-c cgi-program]... <port>\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (optind != argc - 1 || nthreads < 0) {
+    fprintf(stderr, "usage: %s [-t threads] [-c cgi-program]... <port>\n", argv[0]);
     exit(1);
   }
 
-  listenfd = Open_listenfd(argv[1]);
+  fcache_init();
+  listenfd = Open_listenfd(argv[optind]);
+  if (nthreads > 0) {
+    persist = 1;
+    sbuf_init(&sbuf, SBUFSIZE);
+    for (i = 0; i < nthreads; i++)
+      Pthread_create(&tid, NULL, thread, NULL);
+    serve_workers(listenfd);
+  }
+
   while (1) {
     clientlen = sizeof(clientaddr);
     connfd = Accept(listenfd, (SA *)&clientaddr,
                     &clientlen);  // line:netp:tiny:accept
+    // CGI children of other workers must not hold this connection open
+    fcntl(connfd, F_SETFD, FD_CLOEXEC);
     Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE,
                 0);
     printf("Accepted connection from (%s, %s)\n", hostname, port);
-    doit(connfd);   // line:netp:tiny:doit
-    Close(connfd);  // line:netp:tiny:close
+    serve_conn(connfd);   // line:netp:tiny:doit
+    Close(connfd);        // line:netp:tiny:close
   }
 }
 
-void doit(int fd)
+/*
+ * serve_workers - The main thread with workers: accept connections and
+ *     keep the idle persistent ones the workers hand back, queueing each
+ *     for a worker when it has a request to read. One idle for longer
+ *     than KEEPALIVE_TIMEOUT is closed. Never returns.
+ */
+void serve_workers(int listenfd)
 {
-  int is_statc;
+  struct timeval stall = {KEEPALIVE_TIMEOUT, 0};
+  struct epoll_event ev, events[64];
+  struct sockaddr_storage clientaddr;
+  socklen_t clientlen;
+  char hostname[MAXLINE], port[MAXLINE];
+  struct rlimit rl;
+  time_t *idle_until, now, last_sweep = 0;
+  int epfd, connfd, fd, maxfd, top = 0, i, n;
+
+  getrlimit(RLIMIT_NOFILE, &rl);
+  maxfd = rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > 1 << 20 ? 1 << 20 : rl.rlim_cur;
+  idle_until = Calloc(maxfd, sizeof(time_t));   // 0: not idle here
+  if (pipe(idle_pipe) < 0 || (epfd = epoll_create1(0)) < 0)
+    unix_error("serve_workers error");
+  fcntl(idle_pipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(idle_pipe[1], F_SETFD, FD_CLOEXEC);
+  ev.events = EPOLLIN;
+  ev.data.fd = listenfd;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev);
+  ev.data.fd = idle_pipe[0];
+  epoll_ctl(epfd, EPOLL_CTL_ADD, idle_pipe[0], &ev);
+
+  while (1) {
+    if ((n = epoll_wait(epfd, events, 64, 1000)) < 0 && errno != EINTR)
+      unix_error("epoll_wait error");
+    now = time(NULL);
+    for (i = 0; i < n; i++) {
+      fd = events[i].data.fd;
+      if (fd == listenfd) {
+        clientlen = sizeof(clientaddr);
+        connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+        // CGI children of other workers must not hold this connection open
+        fcntl(connfd, F_SETFD, FD_CLOEXEC);
+        // a request that stalls half way gives its worker back in time
+        setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &stall, sizeof(stall));
+        Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE, 0);
+        printf("Accepted connection from (%s, %s)\n", hostname, port);
+        sbuf_insert(&sbuf, connfd);
+      }
+      else if (fd == idle_pipe[0]) {
+        Rio_readn(idle_pipe[0], &connfd, sizeof(connfd));
+        if (connfd >= maxfd) {
+          Close(connfd);
+          continue;
+        }
+        ev.data.fd = connfd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &ev);
+        idle_until[connfd] = now + KEEPALIVE_TIMEOUT;
+        if (connfd >= top)
+          top = connfd + 1;
+      }
+      else {                // the next request, or the client hung up
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+        idle_until[fd] = 0;
+        sbuf_insert(&sbuf, fd);
+      }
+    }
+
+    if (now == last_sweep)
+      continue;
+    last_sweep = now;
+    for (fd = 0; fd < top; fd++)
+      if (idle_until[fd] && now > idle_until[fd]) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+        idle_until[fd] = 0;
+        Close(fd);
+      }
+  }
+}
+
+/*
+ * serve_conn - Requests on fd, one after another and in order. Returns 1
+ *     if it persists with nothing more buffered, so it can wait idle
+ *     without holding the worker.
+ */
+int serve_conn(int fd)
+{
+  rio_t rio;
+
+  // pipelined requests wait in rio's buffer for their turn
+  Rio_readinitb(&rio, fd);
+  while (doit(fd, &rio))
+    if (rio.rio_cnt == 0)
+      return 1;
+  return 0;
+}
+
+/* One request from rp. Returns whether the connection persists. */
+int doit(int fd, rio_t *rp)
+{
+  int is_statc, keep_alive;
   struct stat sbuf;
   char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
   char filename[MAXLINE], cgiargs[MAXLINE];
-  rio_t rio;
 
-  Rio_readinitb(&rio, fd);
-  Rio_readlineb(&rio, buf, MAXLINE);
+  if (rio_readlineb(rp, buf, MAXLINE) <= 0)
+    return 0;
   printf("Request headers:\n");
   printf("%s", buf);
+  *method = *uri = *version = '\0';
   sscanf(buf, "%s %s %s", method, uri, version);
   if (!(strcasecmp(method, "GET") == 0 || strcasecmp(method, "HEAD") == 0)) {
     clienterror(fd, method, "501", "Not implemented", "Tiny does not implement this method");
-    return;
+    return 0;
   }
 
-  read_requesthdrs(&rio);
+  keep_alive = persist && !strcmp(version, "HTTP/1.1");
+  if (read_requesthdrs(rp, &keep_alive) < 0)
+    return 0;
+  keep_alive &= persist;
 
   is_statc = parse_uri(uri, filename, cgiargs);
-  if (stat(filename, &sbuf) < 0) {
-    clienterror(fd, filename, "404", "Not found", "Tiny couldn't find this file");
-    return;
-  }
+  if (is_statc) {
+    fc_entry *e = fcache_get(filename);
 
-  if (is_statc) { 
-    if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-      clienterror(fd, filename, "403", "Forbidden", "Tiny couldn't read the file.");
-      return;
+    if (e == NULL) {
+      if (errno == EACCES)
+        clienterror(fd, filename, "403", "Forbidden", "Tiny couldn't read the file.");
+      else
+        clienterror(fd, filename, "404", "Not found", "Tiny couldn't find this file");
+      return 0;
     }
-    serve_static(fd, filename, sbuf.st_size, method);
+    if (serve_static(fd, e, method, keep_alive) < 0)
+      keep_alive = 0;
+    fcache_put(e);
+    return keep_alive;
   }
   else {
+    if (stat(filename, &sbuf) < 0) {
+      clienterror(fd, filename, "404", "Not found", "Tiny couldn't find this file");
+      return 0;
+    }
     if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
       clienterror(fd, filename, "403", "Forbidden", "Tiny couldn't run the CGI program");
-      return;
+      return 0;
     }
+    // a CGI answer's end is the end of the connection
     serve_dynamic(fd, filename, cgiargs, method);
+    return 0;
   }
 }
 
 void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg)
 {
   char buf[MAXLINE], body[MAXLINE];
+  struct iovec iov[2];
 
   sprintf(body, "<html><title>Tiny Error</title>");
   sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
@@ -94,27 +275,39 @@ void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longms
   sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
   sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
 
-  sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-  Rio_writen(fd, buf, strlen(buf));
-  sprintf(buf, "Content-type: text/html\r\n");
-  Rio_writen(fd, buf, strlen(buf));
-  sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-  Rio_writen(fd, buf, strlen(buf));
-  Rio_writen(fd, body, strlen(body));
+  snprintf(buf, sizeof(buf), "HTTP/1.0 %s %s\r\n"
+           "Content-type: text/html\r\n"
+           "Content-length: %d\r\n\r\n", errnum, shortmsg, (int)strlen(body));
+  iov[0].iov_base = buf;
+  iov[0].iov_len = strlen(buf);
+  iov[1].iov_base = body;
+  iov[1].iov_len = strlen(body);
+  rio_writev(fd, iov, 2);   // the client may be gone; nothing to do then
 }
 
-void read_requesthdrs(rio_t *rp)
+/*
+ * read_requesthdrs - Skip the headers, noting a Connection header's say
+ *     in *keep_alive. -1 if the client went away before the blank line.
+ */
+int read_requesthdrs(rio_t *rp, int *keep_alive)
 {
   char buf[MAXLINE];
+  int i;
 
-  Rio_readlineb(rp, buf, MAXLINE);
-  printf("%s", buf);
-  while (strcmp(buf, "\r\n"))
-  {
-    Rio_readlineb(rp, buf, MAXLINE);
+  do {
+    if (rio_readlineb(rp, buf, MAXLINE) <= 0)
+      return -1;
     printf("%s", buf);
-  }
-  return;
+    if (!strncasecmp(buf, "Connection:", 11)) {
+      for (i = 11; buf[i]; i++)
+        buf[i] = tolower(buf[i]);
+      if (strstr(buf + 11, "close"))
+        *keep_alive = 0;
+      else if (strstr(buf + 11, "keep-alive"))
+        *keep_alive = 1;
+    }
+  } while (strcmp(buf, "\r\n") && strcmp(buf, "\n"));
+  return 0;
 }
 
 int parse_uri(char *uri, char *filename, char *cgiargs)
@@ -123,6 +316,10 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
 
   if(!strstr(uri, "cgi-bin")) {
     strcpy(cgiargs, "");
+    if ((ptr = index(uri, '?')) != NULL)   // a static file takes no arguments
+      *ptr = '\0';
+    if (*uri == '\0')                      // nothing but a query names the root
+      strcpy(uri, "/");
     strcpy(filename, ".");
     strcat(filename, uri);
     if (uri[strlen(uri) - 1] == '/')
@@ -144,64 +341,85 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
   }
 }
 
-void get_filetype(char *filename, char *filetype)
+/*
+ * send_file - Stream count bytes from the start of srcfd to fd with
+ *     sendfile, a chunk at a time, so the file never passes through user
+ *     space. If fd is non-blocking and full, wait until it drains and
+ *     resume at the same offset. Returns 0, or -1 if fd went away.
+ */
+static int send_file(int fd, int srcfd, off_t count)
 {
-  if (strstr(filename, ".html"))
-    strcpy(filetype, "text/html");
-  else if (strstr(filename, ".gif"))
-    strcpy(filetype, "image/gif");
-  else if (strstr(filename, ".png"))
-    strcpy(filetype, "image/png");
-  else if (strstr(filename, ".jpg"))
-    strcpy(filetype, "image/jpeg");
-  else if (strstr(filename, ".mp4"))
-    strcpy(filetype, "video/mp4");
-  else
-    strcpy(filetype, "text/plain");
+  struct pollfd pfd = {fd, POLLOUT, 0};
+  off_t off = 0;
+  ssize_t n;
+
+  while (off < count) {
+    n = sendfile(fd, srcfd, &off,
+                 count - off > SENDFILE_CHUNK ? SENDFILE_CHUNK : count - off);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN && poll(&pfd, 1, -1) >= 0)
+        continue;
+      return -1;
+    }
+    if (n == 0) {           // file shrank under us
+      errno = EIO;
+      return -1;
+    }
+  }
+  return 0;
 }
 
-void serve_static(int fd, char *filename, int filesize, char *method)
+/* -1 if the client didn't get all of it */
+int serve_static(int fd, fc_entry *e, char *method, int keep_alive)
 {
-  int srcfd;
-  char *srcp, filetype[MAXLINE], buf[MAXLINE];
-
-  get_filetype(filename, filetype);
-  sprintf(buf, "HTTP/1.0 200 OK\r\n");
-  sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
-  sprintf(buf, "%sConnection: close\r\n", buf);
-  sprintf(buf, "%sContent-length: %d\r\n", buf, filesize);
-  sprintf(buf, "%sContent-type: %s\r\n\r\n", buf, filetype);
-  Rio_writen(fd, buf, strlen(buf));
+  char *conn = keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+  struct iovec iov[3];
+  struct msghdr msg = {0};
+  int body = strcasecmp(method, "GET") == 0;
+
   printf("Response headers:\n");
-  printf("%s", buf);
+  printf("%.*s%s", (int)e->head_len, e->head, conn);
 
-  if (strcasecmp(method, "GET") == 0)
-  {
-    srcfd = Open(filename, O_RDONLY, 0);
-    // srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-    srcp = Malloc(filesize);
-    Rio_readn(srcfd, srcp, filesize);
-    Close(srcfd);
-    Rio_writen(fd, srcp, filesize);
-    // Munmap(srcp, filesize);
-    Free(srcp);
+  iov[0].iov_base = e->head;
+  iov[0].iov_len = e->head_len;
+  iov[1].iov_base = conn;
+  iov[1].iov_len = strlen(conn);
+  // a small file is in memory: head and body in one writev
+  iov[2].iov_base = e->data;
+  iov[2].iov_len = body && e->data != NULL ? e->size : 0;
+  if (!body || e->data != NULL)
+    return rio_writev(fd, iov, 3) < 0 ? -1 : 0;
+
+  // MSG_MORE: the head waits to share a segment with the file's start
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  if (sendmsg(fd, &msg, MSG_MORE) != (ssize_t)(e->head_len + strlen(conn)) ||
+      send_file(fd, e->fd, e->size) < 0) {
+    fprintf(stderr, "serve_static: %s: %s\n", e->path, strerror(errno));
+    return -1;
   }
+  return 0;
 }
 
 void serve_dynamic(int fd, char *filename, char *cgiargs, char *method)
 {
   char buf[MAXLINE], *emptylist[] = { NULL };
+  pid_t pid;
+
+  if (cgipool_serve(fd, filename, cgiargs, method) == 0)
+    return;
 
-  sprintf(buf, "HTTP/1.0 200 OK\r\n");
-  Rio_writen(fd, buf, strlen(buf));
-  sprintf(buf, "Server: Tiny Web Server\r\n");
-  Rio_writen(fd, buf, strlen(buf));
+  sprintf(buf, "HTTP/1.0 200 OK\r\nServer: Tiny Web Server\r\n");
+  if (rio_writen(fd, buf, strlen(buf)) < 0)
+    return;
 
-  if (Fork() == 0) {
+  if ((pid = Fork()) == 0) {
     setenv("QUERY_STRING", cgiargs, 1);
     setenv("REQUEST_METHOD", method, 1);
     Dup2(fd, STDOUT_FILENO);
     Execve(filename, emptylist, environ);
   }
-  Wait(NULL);
+  Waitpid(pid, NULL, 0);    // only our own child, other workers fork too
 }